@@ -2,6 +2,7 @@
 #ifndef PN532_H
 #define PN532_H
 
+#include "sdkconfig.h"
 #include <malloc.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -9,10 +10,15 @@
 #include <string.h>
 #include <unistd.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define pn532_errs                                                             \
   p(OK) p(NULL) p(NOTPENDING) p(CMDPENDING) p(CMDMISMATCH) p(TIMEOUT) p(       \
       TIMEOUTACK) p(BADACK) p(NACK) p(HEADER) p(SHORT) p(SPACE) p(CHECKSUM)    \
-      p(POSTAMBLE) p(STATUS) s(0x01, TIMEOUT) s(0x02, CRC) s(0x03, PARITY)     \
+      p(POSTAMBLE) p(ABORTED) p(ASLEEP) p(STATUS) s(0x01, TIMEOUT)             \
+          s(0x02, CRC) s(0x03, PARITY)                                         \
           s(0x04, BITCOUNT) s(0x05, FRAMING) s(0x06, COLLISION) s(0x07, SPACE) \
               s(0x09, OVERFLOW) s(0x0A, NOFIELD) s(0x0B, PROTOCOL) s(          \
                   0x0D, TEMPERATURE) s(0x0E, INTOVERFLOW) s(0x10, PARAMETER)   \
@@ -33,11 +39,201 @@ typedef enum {
 
 typedef struct pn532_s pn532_t;
 
+// Storage for pn532_init_static (instance, buffers and mutex) - derived from
+// sdkconfig so the component and the application always agree
+#ifdef CONFIG_PN532_FRAME_SIZE
+#define PN532_FRAME CONFIG_PN532_FRAME_SIZE // Non-blocking response buffer
+#else
+#define PN532_FRAME 128
+#endif
+#define PN532_STATIC_SIZE (1024 + PN532_FRAME)
+typedef struct {
+  uint64_t opaque[(PN532_STATIC_SIZE + sizeof(uint64_t) - 1) / sizeof(uint64_t)];
+} pn532_static_t;
+
+// Command scheduling classes - high priority commands (GPIO/register access)
+// are dispatched at the next frame boundary ahead of any waiting low priority
+// command, and a pending low priority InListPassiveTarget is aborted for them
+typedef enum {
+  PN532_PRIO_LOW,  // Card polling and exchanges
+  PN532_PRIO_HIGH, // Short control commands (LEDs, buzzer, GPIO)
+  PN532_PRIO_MAX
+} pn532_prio_t;
+
+typedef struct {
+  uint32_t count;    // Commands dispatched in this class
+  uint32_t aborts;   // Low priority commands aborted by this class
+  uint32_t max_us;   // Worst queueing delay
+  uint64_t total_us; // Total queueing delay (divide by count for mean)
+} pn532_qstats_t;
+
+typedef struct {
+  uint32_t resyncs;   // Host ACK sent and stale input dropped after a bad frame
+  uint32_t retries;   // Idempotent commands sent again
+  uint32_t recovered; // Commands that worked after retry
+  uint32_t wakes;     // Wake and set up again after repeated failure
+  uint32_t failures;  // Commands that failed after all of the above
+  uint32_t badresyncs; // Resyncs that gave up with input still arriving
+} pn532_recovery_t;
+
+// Low power detection - PowerDown wake sources (WakeUpEnable) and state sent
+// again on resume (the PN532 keeps its RAM and registers in PowerDown, so by
+// default nothing is)
+#define PN532_WAKE_INT0 0x01
+#define PN532_WAKE_INT1 0x02
+#define PN532_WAKE_RF 0x08 // RF level detector (external field)
+#define PN532_WAKE_HSU 0x10
+#define PN532_WAKE_SPI 0x20
+#define PN532_WAKE_GPIO 0x40
+#define PN532_WAKE_I2C 0x80
+#define PN532_LP_RESTORE_REGS 0x01 // Host owned registers (GPIO)
+#define PN532_LP_RESTORE_RF 0x02   // RF profile
+
+typedef struct {
+  uint32_t powerdowns;     // PowerDown commands
+  uint32_t wakes;          // Resumes
+  uint32_t detections;     // Cards found by pn532_lp_detect straight after a wake
+  uint32_t last_uid_us;    // Wake to UID on last detection
+  uint32_t max_uid_us;     // Worst wake to UID
+  uint64_t total_uid_us;   // Total wake to UID (divide by detections for mean)
+  uint64_t up_us;          // Time powered up
+  uint64_t down_us;        // Time in PowerDown
+} pn532_lp_stats_t;
+
+// RF profiles (RFConfiguration retries and timings)
+typedef enum {
+  PN532_RF_DEFAULT,     // PN532 defaults, single passive activation retry
+  PN532_RF_FAST_DETECT, // Short timeouts, no retries - quickest tap to read
+  PN532_RF_ROBUST,      // Long timeouts, more retries - weak or distant cards
+  PN532_RF_LOW_POWER,   // Minimum RF on time per poll
+  PN532_RF_MAX
+} pn532_rf_profile_t;
+
+typedef struct {
+  pn532_rf_profile_t profile; // Profile measured
+  uint32_t polls;             // InListPassiveTarget polls made
+  uint32_t errors;            // Polls that failed
+  uint32_t detects;           // Cards found after an empty poll (new taps)
+  uint32_t empty;             // Empty polls before those detections
+  uint32_t exchanges;         // InDataExchange with a newly detected card
+  uint32_t failures;          // Exchanges that failed
+  uint32_t detect_us_max;     // Worst time from first empty poll to detection
+  uint64_t detect_us_total;   // Total time to detection (divide by detects)
+} pn532_rf_measure_t;
+
+// Multi-protocol polling - one InListPassiveTarget per protocol per cycle,
+// stopping at the first card, ordered by how often each protocol turns up
+// against what a miss costs, protocols not seen recently polled only now and
+// then
+typedef enum {
+  PN532_PROTO_A,         // 106 kbps Type A (ISO/IEC14443 Type A, MIFARE)
+  PN532_PROTO_B,         // 106 kbps Type B (ISO/IEC14443-3B)
+  PN532_PROTO_FELICA212, // 212 kbps FeliCa
+  PN532_PROTO_FELICA424, // 424 kbps FeliCa
+  PN532_PROTO_JEWEL,     // 106 kbps Innovision Jewel/Topaz
+  PN532_PROTO_MAX
+} pn532_proto_t;
+#define PN532_PROTO_ALL ((1 << PN532_PROTO_MAX) - 1) // Mask of all protocols
+
+typedef struct {
+  uint32_t polls;    // InListPassiveTarget attempts
+  uint32_t hits;     // Attempts that found a card
+  uint32_t errors;   // Attempts that failed
+  uint32_t skips;    // Cycles it was left out of
+  uint32_t weight;   // Recent share of detections (65536 for all of them)
+  uint64_t miss_us;  // Time in attempts that found nothing (divide by
+                     // polls - hits - errors for the cost of a miss)
+  uint64_t total_us; // Time in all attempts
+} pn532_proto_stats_t;
+
+typedef struct {
+  uint8_t protos;                 // Protocols polled (1 << pn532_proto_t)
+  uint8_t adaptive;               // Reorder and skip from what turns up
+  uint8_t afi;                    // Type B AFI (0 for all)
+  uint8_t probe;                  // Cycles between polls of a cold protocol
+  uint16_t syscode;               // FeliCa system code (0xFFFF for any)
+  uint8_t count;                  // Protocols in order
+  uint8_t order[PN532_PROTO_MAX]; // Poll order
+  uint32_t cycles;                // Poll cycles
+  uint32_t detects;               // Cycles that found a card
+  uint64_t cycle_us;              // Time in all cycles (divide by cycles)
+  uint64_t hit_us;                // Cycle start to card found (divide by
+                                  // detects)
+  pn532_proto_stats_t stats[PN532_PROTO_MAX];
+} pn532_multi_t; // Caller owned (e.g. static), one per reader, set up by
+                 // pn532_multi_config
+
+// Card families
+typedef enum {
+  PN532_FAMILY_UNKNOWN,
+  PN532_FAMILY_TYPE2,      // Type 2, size not known yet (or CC not set)
+  PN532_FAMILY_ULTRALIGHT, // MIFARE Ultralight (no GET_VERSION, CC 48 bytes)
+  PN532_FAMILY_NTAG203,    // NTAG203 or Ultralight C (no GET_VERSION, CC 144)
+  PN532_FAMILY_ULTRALIGHT_EV1_11,
+  PN532_FAMILY_ULTRALIGHT_EV1_21,
+  PN532_FAMILY_NTAG213,
+  PN532_FAMILY_NTAG215,
+  PN532_FAMILY_NTAG216,
+  PN532_FAMILY_CLASSIC_MINI,
+  PN532_FAMILY_CLASSIC_1K,
+  PN532_FAMILY_CLASSIC_4K,
+  PN532_FAMILY_DESFIRE,
+  PN532_FAMILY_ISO14443_4, // Other ISO/IEC14443-4 card
+  PN532_FAMILY_FELICA,
+  PN532_FAMILY_ISO14443B, // ISO/IEC14443 Type B
+  PN532_FAMILY_JEWEL,     // Innovision Jewel/Topaz
+  PN532_FAMILY_MAX
+} pn532_family_t;
+
+#define PN532_FAST_READ16 0x01     // READ returns 4 pages
+#define PN532_FAST_FASTREAD 0x02   // FAST_READ page range (0x3A)
+#define PN532_FAST_GETVERSION 0x04 // GET_VERSION (0x60)
+#define PN532_FAST_AUTH 0x08       // MIFARE Classic authentication
+#define PN532_FAST_APDU 0x10       // ISO/IEC14443-4 APDUs
+
+typedef enum {
+  PN532_PRESENCE_REPOLL,   // InListPassiveTarget again
+  PN532_PRESENCE_DIAGNOSE, // ISO/IEC14443-4 presence check (Diagnose test 6)
+  PN532_PRESENCE_READ,     // Read page 0
+} pn532_presence_t;
+
+typedef struct {
+  pn532_family_t family;
+  const char *name;
+  uint16_t memory;           // User memory bytes (0 if it varies)
+  uint8_t last;              // Last user page or block (0 if not paged)
+  uint8_t fast;              // PN532_FAST_ commands supported
+  pn532_presence_t presence; // Cheapest presence check
+  uint8_t probe;             // Guess from SAK/ATQA, GET_VERSION would refine
+} pn532_family_desc_t;
+
+// Bit rates (InPSL BRit/BRti)
+#define PN532_BR_106 0
+#define PN532_BR_212 1
+#define PN532_BR_424 2
+#define PN532_BR_848 3
+
+typedef struct {
+  uint16_t it_kbps;       // Reader to card
+  uint16_t ti_kbps;       // Card to reader
+  uint32_t exchanges;     // pn532_dx exchanges above 106 kbps
+  uint32_t last_saved_us; // Air time saved on last exchange
+  uint64_t saved_us;      // Air time saved in total
+} pn532_rate_t;
+
 #define PN532_COMMAND_INDATAEXCHANGE 0x40
 #define MIFARE_CMD_WRITE 0xA0
 #define MIFARE_ULTRALIGHT_CMD_WRITE 0xA2
 #define MIFARE_CMD_READ 0x30
 
+// SFR registers (ReadRegister/WriteRegister)
+#define PN532_REG_P3 0xFFB0
+#define PN532_REG_P3CFGA 0xFFFC
+#define PN532_REG_P3CFGB 0xFFFD
+#define PN532_REG_P7 0xFFF7
+#define PN532_REG_P7CFGA 0xFFF4
+#define PN532_REG_P7CFGB 0xFFF5
+
 #define NTAG_203_MAX_PAGE (39)
 #define NTAG_213_MAX_PAGE (39)
 #define NTAG_215_MAX_PAGE (129)
@@ -51,10 +247,14 @@ pn532_init(int8_t uart, uint8_t baud, int8_t tx, int8_t rx,
            uint8_t p3); // Init PN532 (P3 is port 3 output bits in use), baud is
                         // speed code 0-8 for 9600-1288000
 
+pn532_t *pn532_init_static(
+    pn532_static_t *mem, int8_t uart, uint8_t baud, int8_t tx, int8_t rx,
+    uint8_t p3); // As pn532_init using caller provided storage, no heap
+
 // Deinit
 int pn532_deinit(pn532_t *p);
 
-void *pn532_end(pn532_t *p); // Close and free
+void *pn532_end(pn532_t *p); // Close and free (if not static)
 pn532_err_t pn532_lasterr(pn532_t *);
 const char *pn532_err_to_name(pn532_err_t);
 
@@ -62,6 +262,9 @@ const char *pn532_err_to_name(pn532_err_t);
 int pn532_tx(pn532_t *, uint8_t cmd, int, uint8_t *, int,
              uint8_t *); // Send data to PN532 (up to two blocks) return 0 or
                          // negative for error. Starts byte after cmd
+int pn532_tx_prio(pn532_t *, pn532_prio_t, uint8_t cmd, int, uint8_t *, int,
+                  uint8_t *); // As pn532_tx with explicit scheduling class
+                              // (pn532_tx picks the class from cmd)
 int pn532_ready(
     pn532_t *p); // For async command handling: >0 if response ready, 0 if not,
                  // -ve if error (e.g. no response expected)
@@ -87,17 +290,280 @@ int pn532_release(pn532_t *p, uint8_t n);  // Send release ID 1 or 2
 int pn532_write_GPIO(pn532_t *p,
                      uint8_t value); // (P72/P71 in top bits, P35-30 in rest)
 int pn532_read_GPIO(pn532_t *p);     // P72/P71 in top bits, P35-30 in rest)
+int pn532_read_GPIO_inputs(pn532_t *p); // As pn532_read_GPIO, always reads
+                                        // the pins (ignores output shadow)
 int pn532_ILPT_Send(pn532_t *p); // Async InListPassiveTarget - used pn532_ready
                                  // to check when to do pn532_Cards
+int pn532_felica_ILPT_Send(
+    pn532_t *p, uint8_t br,
+    uint16_t syscode); // Async InListPassiveTarget for FeliCa at PN532_BR_212
+                       // or PN532_BR_424, polling system code (0xFFFF any)
+int pn532_ILPT_Start(pn532_t *p,
+                     uint32_t now); // Non-blocking InListPassiveTarget - use
+                                    // pn532_poll to check when to do
+                                    // pn532_Cards
 int pn532_Cards(
-    pn532_t *p); // How many cards present (does pn532_ILPT_Send if needed)
+    pn532_t *p); // How many cards present (polls again as last
+                 // pn532_ILPT_Send/pn532_felica_ILPT_Send if needed, or uses
+                 // InListPassiveTarget completed by pn532_poll),
+                 // PN532_ERR_ABORTED if a high priority command took over
+                 // the poll sent
 int pn532_Present(pn532_t *p); // Check if present still
 
+// Card identification - from SAK/ATQA/ATS on each pn532_Cards, refined by an
+// NTAG GET_VERSION probe in pn532_identify, cached per UID
+const pn532_family_desc_t *
+pn532_family(pn532_t *p); // Family of first card from last pn532_Cards
+const pn532_family_desc_t *
+pn532_identify(pn532_t *p); // As pn532_family, probing the card if needed
+
+// FeliCa
+int pn532_felica_id(pn532_t *p, uint8_t idm[8], uint8_t pmm[8],
+                    uint16_t *syscode); // IDm/PMm/system code from last poll
+int pn532_felica_read(
+    pn532_t *p, uint16_t service, uint16_t block, int count,
+    uint8_t *data); // Read Without Encryption of count 16 byte blocks,
+                    // packing as many per command as card and frame allow
+int pn532_felica_status(
+    pn532_t *p); // Status flag 1 << 8 | status flag 2 of the card refusing
+                 // the last pn532_felica_read (0 if it did not)
+
+// Bit rate (ISO/IEC14443-4 cards, from TA(1) in ATS)
+int pn532_psl(pn532_t *p,
+              uint8_t max); // InPSL to highest common rate up to max
+                            // (PN532_BR_), falls back to lower rates, returns
+                            // kbps. Only straight after pn532_Cards
+void pn532_psl_auto(pn532_t *p,
+                    uint8_t max); // pn532_Cards does pn532_psl (0 for off),
+                                  // not when collecting a non-blocking poll
+int pn532_rate(pn532_t *p, pn532_rate_t *r); // Rate in use and time saved
+
+// RF profiles
+int pn532_rf_profile(pn532_t *p,
+                     pn532_rf_profile_t profile); // Switch RF profile
+pn532_rf_profile_t pn532_rf_profile_get(pn532_t *p); // Profile in use
+const char *pn532_rf_profile_name(pn532_rf_profile_t profile);
+int pn532_rf_measure(
+    pn532_t *p, pn532_rf_profile_t profile, int polls,
+    pn532_rf_measure_t *m); // Poll with profile (tap cards while running),
+                            // returns detections or -ve for error
+
+// Multi-protocol polling
+int pn532_multi_config(
+    pn532_multi_t *m, uint8_t protos, uint8_t afi, uint16_t syscode,
+    int adaptive); // Protocols (1 << pn532_proto_t, in enum order to start),
+                   // Type B AFI, FeliCa system code, and whether to adapt
+                   // the order. Clears the statistics
+int pn532_multi_poll(
+    pn532_t *p,
+    pn532_multi_t *m); // One cycle, returns cards (as pn532_Cards, for the
+                       // protocol that found one) or -ve for error. Leaves
+                       // that protocol set up for pn532_Present
+int pn532_multi_stats(pn532_multi_t *m, pn532_proto_stats_t *s,
+                      uint8_t *order); // Per protocol statistics (indexed
+                                       // by pn532_proto_t) and poll order,
+                                       // returns protocols in order
+const char *pn532_proto_name(pn532_proto_t proto);
+
+// Register access (ReadRegister/WriteRegister) - SFR registers (0xFFxx) the
+// host writes are kept in a shadow copy, unchanged writes are skipped and reads
+// are served from the shadow. Queued writes are coalesced in to one frame.
+int pn532_read_register(pn532_t *p,
+                        uint16_t addr); // Value or -ve for error
+int pn532_read_registers(pn532_t *p, int n, const uint16_t *addr,
+                         uint8_t *val); // Read up to 32 in one frame
+int pn532_write_register(pn532_t *p, uint16_t addr,
+                         uint8_t val); // Write now (with anything queued)
+int pn532_queue_register(
+    pn532_t *p, uint16_t addr,
+    uint8_t val); // Queue write, sent once the window has passed
+int pn532_flush_registers(pn532_t *p); // Send queued writes now (call when
+                                       // a burst ends, nothing else will
+                                       // until the next command)
+void pn532_register_window(
+    pn532_t *p, int ms); // Coalesce window for queued writes and GPIO writes
+                         // (default 0, i.e. send on each call)
+
+// Low power detection
+int pn532_lp_config(
+    pn532_t *p, uint8_t wake,
+    uint8_t restore);          // Wake sources (PN532_WAKE_, HSU always on) and
+                               // state to send again on resume (PN532_LP_RESTORE_)
+int pn532_power_down(pn532_t *p); // PowerDown now
+int pn532_resume(pn532_t *p); // Wake if powered down (done by any blocking
+                              // command too)
+int pn532_lp_detect(
+    pn532_t *p); // Resume, list targets at once, and power down again if none.
+                 // Returns cards (0 if now powered down) or -ve for error
+int pn532_lp_stats(pn532_t *p, pn532_lp_stats_t *s); // Wake to UID, time per
+                                                     // power state
+
+// Target mode (ISO/IEC14443-4 card emulation) - the handler builds each
+// response APDU straight in to a pre-built TgSetData frame
+#ifndef PN532_TARGET_MAX
+#define PN532_TARGET_MAX 262 // Largest APDU each way
+#endif
+typedef int pn532_apdu_handler_t(
+    void *arg, const uint8_t *apdu, int len, uint8_t *res,
+    int max); // Response APDU (inc SW1 SW2) in res, returns len or -ve to end
+              // the session
+
+typedef struct {
+  uint32_t sessions;          // Readers that selected us
+  uint32_t apdus;             // APDUs answered
+  uint32_t releases;          // Sessions ended by the reader going
+  uint32_t errors;            // Sessions ended by an error
+  uint32_t last_handler_us;   // Handler time, last APDU
+  uint32_t max_handler_us;    // Handler time, worst
+  uint64_t total_handler_us;  // Handler time, total (divide by apdus)
+  uint32_t last_turn_us;      // APDU in to response sent, last APDU
+  uint32_t max_turn_us;       // APDU in to response sent, worst
+  uint64_t total_turn_us;     // APDU in to response sent, total
+} pn532_target_stats_t;
+
+typedef struct {
+  pn532_apdu_handler_t *handler;
+  void *arg;
+  uint8_t init[52];                   // TgInitAsTarget parameters
+  uint8_t initlen;                    // TgInitAsTarget parameters length
+  uint8_t apdu[PN532_TARGET_MAX];     // Command APDU from TgGetData
+  uint8_t set[PN532_TARGET_MAX + 12]; // TgSetData frame, built in place
+  pn532_target_stats_t stats;
+} pn532_target_t; // Caller owned (e.g. static), set up by pn532_target_init
+
+int pn532_target_init(pn532_target_t *t, const uint8_t nfcid[3],
+                      const uint8_t *hist, int histlen,
+                      pn532_apdu_handler_t *handler,
+                      void *arg); // NFCID1 (PN532 adds 0x08 in front) and ATS
+                                  // historical bytes (up to 15)
+int pn532_target(pn532_t *p, pn532_target_t *t,
+                 int ms); // Wait up to ms for a reader, then answer its APDUs
+                          // until it goes. Returns APDUs answered (0 if no
+                          // reader) or -ve for error. Holds the reader, high
+                          // priority commands get in between APDUs
+int pn532_target_stats(pn532_target_t *t, pn532_target_stats_t *s);
+
+// Card scripts - a sequence of PN532 commands and card exchanges encoded as
+// frames once, with parameter slots filled per run, run under one hold of
+// the reader and stopping at the first step to fail
+#ifndef PN532_SCRIPT_STEPS
+#define PN532_SCRIPT_STEPS 16 // Steps per script
+#endif
+#ifndef PN532_SCRIPT_SLOTS
+#define PN532_SCRIPT_SLOTS 16 // Parameter slots per script
+#endif
+#ifndef PN532_SCRIPT_BYTES
+#define PN532_SCRIPT_BYTES 512 // Encoded frames, and replies, per script
+#endif
+
+typedef struct {
+  uint8_t cmd;    // PN532 command
+  uint8_t dx;     // InDataExchange to current card (status byte in reply)
+  uint16_t frame; // Encoded frame (offset in frames)
+  uint16_t len;   // Encoded frame length
+  uint16_t reply; // Reply space (offset in replies)
+  uint16_t max;   // Reply space length
+} pn532_script_step_t;
+
+typedef struct {
+  uint8_t step; // Step whose data the slot is in
+  uint8_t len;  // Bytes (0 for card UID, 4 bytes)
+  uint16_t at;  // Offset in step data
+  uint16_t from; // Offset in run parameters
+} pn532_script_slot_t;
+
+typedef struct {
+  uint8_t steps;     // Steps in use
+  uint8_t slots;     // Slots in use
+  uint16_t framelen; // Frames in use
+  uint16_t replylen; // Replies in use
+  pn532_script_step_t step[PN532_SCRIPT_STEPS];
+  pn532_script_slot_t slot[PN532_SCRIPT_SLOTS];
+  uint8_t frames[PN532_SCRIPT_BYTES];
+  uint8_t replies[PN532_SCRIPT_BYTES];
+} pn532_script_t; // Caller owned (e.g. static), built by pn532_script_ calls
+
+void pn532_script_init(pn532_script_t *s); // Empty script
+int pn532_script_cmd(pn532_script_t *s, uint8_t cmd, const uint8_t *data,
+                     int len, int max); // PN532 command, reply up to max
+                                        // kept. Returns step or -ve
+int pn532_script_dx(pn532_script_t *s, const uint8_t *data, int len,
+                    int max); // Card exchange as pn532_dx. Returns step or -ve
+int pn532_script_param(pn532_script_t *s, int step, int at, int from,
+                       int len); // Step data at..at+len-1 taken from run
+                                 // parameters from.. on each run
+int pn532_script_uid(pn532_script_t *s, int step,
+                     int at); // Step data at..at+3 is current card UID
+int pn532_script_ntag_write(pn532_script_t *s, uint8_t page,
+                            int from); // WRITE page, 4 bytes from parameters
+int pn532_script_ntag_read(pn532_script_t *s,
+                           uint8_t page); // READ 4 pages from page
+int pn532_script_classic_auth(
+    pn532_script_t *s, uint8_t block, uint8_t keytype,
+    const uint8_t key[6]); // Authenticate with key A (0x60) or B (0x61),
+                           // card UID filled in on each run
+int pn532_script_classic_write(
+    pn532_script_t *s, uint8_t block,
+    int from); // Write block, 16 bytes from parameters
+int pn532_script_run(
+    pn532_t *p, pn532_script_t *s, const uint8_t *params,
+    int *results); // Run all steps, results[step] is reply len or -ve
+                   // (PN532_ERR_ABORTED if not run after a failure).
+                   // Returns steps or -ve error of the failed step. A
+                   // reply longer than max fails its step (SPACE)
+uint8_t *pn532_script_reply(pn532_script_t *s,
+                            int step); // Reply of step on last run (replies
+                                       // are per script, one reader at a
+                                       // time)
+
+// Non-blocking access - for single threaded loops, nothing here waits
+typedef enum {
+  PN532_POLL_IDLE,     // No command started
+  PN532_POLL_BUSY,     // Waiting for ACK or response
+  PN532_POLL_COMPLETE, // Response ready for pn532_collect
+  PN532_POLL_ERROR,    // Failed, pn532_collect returns the error
+} pn532_poll_t;
+
+int pn532_start(pn532_t *p, uint32_t now, int ms, uint8_t cmd, int len1,
+                uint8_t *data1, int len2,
+                uint8_t *data2); // Send command (now and ms timeout in ms),
+                                 // -ve if another command is in progress,
+                                 // powered down (PN532_ERR_ASLEEP,
+                                 // pn532_resume first) or
+                                 // data is over PN532_FRAME bytes. Until
+                                 // collected, blocking calls on this
+                                 // reader return PN532_ERR_CMDPENDING
+pn532_poll_t pn532_poll(pn532_t *p,
+                        uint32_t now); // Advance using buffered bytes only
+int pn532_collect(pn532_t *p, int max1, uint8_t *data1, int max2,
+                  uint8_t *data2); // Get response once complete (as
+                                   // pn532_rx), ready for next pn532_start
+int pn532_dx_start(pn532_t *p, uint32_t now, unsigned int len,
+                   uint8_t *data); // Non-blocking pn532_dx (-ve if no card)
+int pn532_dx_collect(pn532_t *p, unsigned int max,
+                     uint8_t *data); // Reply once complete, as pn532_dx
+
+// Scheduling instrumentation
+int pn532_qstats(pn532_t *, pn532_prio_t,
+                 pn532_qstats_t *);  // Get queueing delay stats for a class
+void pn532_qstats_reset(pn532_t *); // Clear queueing delay stats
+int pn532_recovery(pn532_t *,
+                   pn532_recovery_t *); // Get protocol error recovery counters
+
 // New
 uint32_t pn532_get_firmware_version(pn532_t *p);
 int pn532_mifareclassic_FormatNDEF(pn532_t *obj);
 int pn532_ntag2xx_WritePage(pn532_t *obj, uint8_t page, uint8_t *data);
 int pn532_ntag2xx_ReadPage(pn532_t *obj, uint8_t page, uint8_t *buffer);
-void pn532_ntag2xx_erase(pn532_t *obj, uint8_t ntag_max_page);
+void pn532_ntag2xx_erase(pn532_t *obj,
+                         uint8_t ntag_max_page); // 0 for identified card size
+int pn532_ntag2xx_max_page(pn532_t *obj); // Last user page of identified card
+                                          // (0 if size not known)
+int pn532_ntag2xx_ReadPages(pn532_t *obj, uint8_t page, uint8_t count,
+                            uint8_t *buffer); // FAST_READ where supported
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
\ No newline at end of file
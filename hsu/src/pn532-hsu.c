@@ -3,6 +3,7 @@
 #include "sdkconfig.h"
 #include "pn532.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include <driver/uart.h>
 #include <driver/gpio.h>
 
@@ -23,11 +24,58 @@
 #define DXLOG ESP_LOG_INFO
 #define MSGLOG ESP_LOG_ERROR
 #define RX_BUF 280
-#define TX_BUF UART_FIFO_LEN + 1
+#define PN532_TX_FRAME(n) ((n) + 15) // Command frame for n bytes of data (wake bytes, header, checksum, postamble)
+#define TX_BUF (2 * PN532_TX_FRAME(PN532_FRAME) > UART_FIFO_LEN + 1 ? 2 * PN532_TX_FRAME(PN532_FRAME) : UART_FIFO_LEN + 1) // pn532_start frame fits without waiting (ring buffer item headers and split included)
+#define PN532_SHADOW 16 // Host owned registers held in shadow
+#define PN532_REGQ 16   // Register writes that can be queued
+#define PN532_IDCACHE 8 // Cards remembered by UID
+#define PN532_FELICA_BLOCKS 14 // Most FeliCa blocks read fits a normal frame
+#define PN532_RETRIES 3        // Retries of idempotent commands
+#define PN532_WAKE_AFTER 3     // Failed frames in a row before wake and set up again
+#define PN532_RESYNC_MS 50     // Most time spent dropping input on a resync
+#define PN532_WAKE_US 2000     // PowerDown to ready after HSU wake (oscillator start)
+#ifdef CONFIG_PN532_UART_EVENTS
+#define PN532_EVENTS CONFIG_PN532_UART_EVENTS // UART event queue depth (0 for polled receive)
+#else
+#define PN532_EVENTS 16
+#endif
+#define PN532_RX_TOUT 2 // Symbol times of idle line before UART rx timeout event
+
+enum
+{ // Frame parser states
+  PN532_F_PRE,   // Looking for 00 FF
+  PN532_F_LEN,   // LEN
+  PN532_F_LCS,   // LCS
+  PN532_F_XLENM, // Extended LEN MSB
+  PN532_F_XLENL, // Extended LEN LSB
+  PN532_F_XLCS,  // Extended LCS
+  PN532_F_TFI,   // D5
+  PN532_F_CMD,   // Response code
+  PN532_F_DATA,  // Data
+  PN532_F_DCS,   // Checksum
+  PN532_F_POST,  // Postamble
+};
+
+typedef struct
+{
+  uint16_t addr;
+  uint8_t val;
+} pn532_reg_t;
+
+#if defined(CONFIG_PN532_RF_PROFILE_FAST_DETECT)
+#define PN532_RF_INIT PN532_RF_FAST_DETECT
+#elif defined(CONFIG_PN532_RF_PROFILE_ROBUST)
+#define PN532_RF_INIT PN532_RF_ROBUST
+#elif defined(CONFIG_PN532_RF_PROFILE_LOW_POWER)
+#define PN532_RF_INIT PN532_RF_LOW_POWER
+#else
+#define PN532_RF_INIT PN532_RF_DEFAULT
+#endif
 
 struct pn532_s
 {
   uint8_t uart;             // Which UART
+  QueueHandle_t queue;      // UART events (NULL if polled receive)
   volatile uint8_t pending; // Pending response
   uint8_t lasterr;          // Last error (obviously not for PN532_ERR_NULL)
   uint8_t cards;            // Cards present (0, 1 or 2)
@@ -36,9 +84,79 @@ struct pn532_s
   uint8_t sel_res;          // From InListPassiveTarget
   uint8_t nfcid[11];        // First card ID last seen (starts with len)
   uint8_t ats[30];          // First card ATS last seen (starts with len)
+  uint8_t isstatic;         // Storage provided by caller
   SemaphoreHandle_t mutex;  // DX mutex
+  StaticSemaphore_t mutexbuf; // DX mutex storage
+  portMUX_TYPE lock;        // Guards the hand over between priority classes
+  uint8_t prio;             // Priority class of command holding the mutex
+  volatile uint8_t hiwait;  // High priority commands waiting for the mutex
+  volatile uint8_t rxbusy;  // Response a task is waiting for in pn532_rx
+  volatile uint8_t abort;   // Abort requested for pending low priority poll
+  volatile uint8_t aborted; // Pending poll taken over, next pn532_Cards reports it
+  pn532_qstats_t qstats[PN532_PRIO_MAX]; // Queueing delay per class
+  uint8_t outputs;          // GPIO bits that are host outputs
+  uint8_t nshadow;          // Registers in shadow
+  uint8_t nregq;            // Register writes queued
+  uint16_t regwindow;       // ms to hold queued register writes
+  int64_t regqtime;         // When first queued register write was queued
+  pn532_reg_t shadow[PN532_SHADOW]; // Host owned registers, as last written
+  pn532_reg_t regq[PN532_REGQ];     // Queued register writes
+  pn532_reg_t fregs[PN532_SHADOW];  // SFRs written by a non-blocking command, for the shadow once done
+  uint8_t nfregs;                   // Entries in fregs
+  uint8_t rfprofile;        // RF profile in use
+  const pn532_family_desc_t *family; // First card family
+  uint8_t idnext;                    // Next idcache entry to replace
+  struct
+  {
+    uint8_t nfcid[11];
+    const pn532_family_desc_t *family;
+  } idcache[PN532_IDCACHE]; // Family by UID
+  uint8_t rxbuf[100];       // InListPassiveTarget response
+  uint8_t brit;             // Bit rate initiator to target (PN532_BR_)
+  uint8_t brti;             // Bit rate target to initiator (PN532_BR_)
+  uint8_t pslauto;          // Highest bit rate pn532_Cards negotiates (0 for off)
+  uint32_t pslexchanges;    // Exchanges at raised bit rate
+  uint32_t psllast;         // Time saved on last exchange (us)
+  uint64_t pslsaved;        // Time saved in total (us)
+  uint8_t brty;             // InListPassiveTarget BrTy polled
+  uint8_t initlen;          // InListPassiveTarget InitiatorData len
+  uint8_t initdata[5];      // InListPassiveTarget InitiatorData
+  uint8_t idm[8];           // FeliCa IDm
+  uint8_t pmm[8];           // FeliCa PMm
+  uint16_t syscode;         // FeliCa system code (if requested)
+  uint8_t felicamax;        // FeliCa blocks per read limit found (0 if not yet)
+  uint8_t fidm[8];          // FeliCa IDm felicamax is for
+  uint16_t felicasf;        // FeliCa status flags 1/2 of last refused read
+  uint8_t rfails;           // Frames failed in a row (recoverable errors)
+  uint8_t fresync;          // Drop stale input before next non-blocking command
+  pn532_recovery_t recovery; // Recovery counters
+  uint8_t lpwake;           // PowerDown wake sources
+  uint8_t lprestore;        // State to send again on resume
+  uint8_t lpdown;           // In PowerDown
+  uint8_t lpwoken;          // Woken by pn532_lp_detect, wake to UID not yet timed
+  int64_t lpsince;          // When power state last changed
+  int64_t lpwoke;           // When last woken
+  pn532_lp_stats_t lpstats; // Low power accounting
+  uint8_t fphase;           // Non-blocking command (pn532_poll_t)
+  uint8_t fstate;           // Frame parser state
+  uint8_t flast;            // Last byte (preamble search)
+  uint8_t fcmd;             // Response code expected
+  uint8_t fack;             // ACK seen
+  uint8_t fsum;             // Checksum so far
+  uint16_t flen;            // Data length (after response code)
+  uint16_t fpos;            // Data received
+  uint8_t *fbuf1;           // Where data goes, first part
+  uint8_t *fbuf2;           // Where data goes, rest
+  uint16_t fmax1;           // Space at fbuf1
+  uint16_t fmax2;           // Space at fbuf2
+  uint16_t fms;             // Non-blocking command timeout
+  uint16_t dxlen;           // Length sent by pn532_dx_start (bit rate saving)
+  uint32_t fstart;          // Non-blocking command start
+  uint8_t frame[PN532_FRAME]; // Non-blocking response data
 };
 
+_Static_assert(sizeof(struct pn532_s) <= sizeof(pn532_static_t), "PN532_STATIC_SIZE too small");
+
 // Data
 static const char *const pn532_err_str[PN532_ERR_STATUS_MAX + 1] = {
 #define p(n) [PN532_ERR_##n] = "PN532_ERR_" #n,
@@ -102,28 +220,638 @@ static int uart_tx(pn532_t *p, const uint8_t *src, size_t size)
 }
 
 static int uart_preamble(pn532_t *p, int ms)
-{ // Wait for preamble
+{ // Wait for preamble, in slices so a high priority command can abort a waiting poll
   if (!p)
     return -PN532_ERR_NULL;
   uint8_t last = 0xFF;
+  int64_t end = esp_timer_get_time() + ms * 1000LL;
   while (1)
   {
+    if (p->abort)
+      return -PN532_ERR_ABORTED;
+    int left = (end - esp_timer_get_time()) / 1000;
+    if (left > 20)
+      left = 20;
     uint8_t c;
-    int l = uart_rx(p, &c, 1, ms);
-    if (l < 1)
+    int l = uart_rx(p, &c, 1, left);
+    if (l < 1 && esp_timer_get_time() >= end)
       return l;
+    if (l < 1)
+      continue;
     if (last == 0x00 && c == 0xFF)
       return 2;
     last = c;
   }
 }
 
+static void uart_abort(pn532_t *p)
+{ // ACK from host aborts the command in progress
+  static const uint8_t ack[] = {0x00, 0x00, 0xFF, 0x00, 0xFF, 0x00};
+  uart_tx(p, ack, sizeof(ack));
+  uart_wait_tx_done(p->uart, 100 / portTICK_PERIOD_MS);
+  uart_flush_input(p->uart);
+}
+
+static void pn532_frame_rx(pn532_t *p, uint8_t cmd, int max1, uint8_t *data1, int max2, uint8_t *data2)
+{ // Set frame parser up for response to cmd, data going to data1 then data2
+  p->fcmd = cmd;
+  p->fstate = PN532_F_PRE;
+  p->flast = 0xFF;
+  p->fbuf1 = data1;
+  p->fmax1 = (data1 ? max1 : 0);
+  p->fbuf2 = data2;
+  p->fmax2 = (data2 ? max2 : 0);
+}
+
+static int pn532_feed(pn532_t *p, uint8_t c);
+
+static int uart_event_wait(pn532_t *p, int ms)
+{ // Feed bytes to the frame parser as UART events arrive, returns 1 for ACK, 2 for response, -ve for error
+  int64_t end = esp_timer_get_time() + ms * 1000LL;
+  while (1)
+  {
+    size_t n = 0;
+    uart_get_buffered_data_len(p->uart, &n);
+    while (n)
+    { // Take no more than the frame in progress needs, anything after it is for the next wait
+      uint8_t buf[16];
+      size_t want = 1;
+      if (p->fstate == PN532_F_DATA)
+        want = p->flen - p->fpos;
+      if (want > sizeof(buf))
+        want = sizeof(buf);
+      if (want > n)
+        want = n;
+      int l = uart_read_bytes(p->uart, buf, want, 0);
+      if (l <= 0)
+        break;
+#ifdef CONFIG_PN532_DUMP
+      ESP_LOG_BUFFER_HEX_LEVEL("NFCRx", buf, l, HEXLOG);
+#endif
+      n -= l;
+      for (int i = 0; i < l; i++)
+      {
+        int r = pn532_feed(p, buf[i]);
+        if (r)
+          return r;
+      }
+    }
+    if (p->abort)
+      return -PN532_ERR_ABORTED;
+    int64_t left = end - esp_timer_get_time();
+    if (left <= 0)
+      return -PN532_ERR_TIMEOUT;
+    uart_event_t e;
+    if (xQueueReceive(p->queue, &e, (left + portTICK_PERIOD_MS * 1000 - 1) / (portTICK_PERIOD_MS * 1000)) == pdTRUE && (e.type == UART_FIFO_OVF || e.type == UART_BUFFER_FULL))
+    { // Lost bytes
+      uart_flush_input(p->uart);
+      xQueueReset(p->queue);
+      return -PN532_ERR_SPACE;
+    }
+  }
+}
+
+static pn532_prio_t pn532_cmd_prio(uint8_t cmd)
+{ // Default scheduling class for a command
+  switch (cmd)
+  {
+  case 0x06: // ReadRegister
+  case 0x08: // WriteRegister
+  case 0x0C: // ReadGPIO
+  case 0x0E: // WriteGPIO
+    return PN532_PRIO_HIGH;
+  }
+  return PN532_PRIO_LOW;
+}
+
+static int pn532_preempt(pn532_t *p)
+{ // High priority command waiting - abort a pending low priority poll, returns 1 if we took over the mutex from it
+  int took = 0;
+  portENTER_CRITICAL(&p->lock);
+  if (p->prio == PN532_PRIO_LOW)
+  { // InListPassiveTarget, TgInitAsTarget or TgGetData outstanding
+    if (p->rxbusy == 0x4B || p->rxbusy == 0x8D || p->rxbusy == 0x87)
+      p->abort = 1; // Waiter for a card or reader will abort and release the mutex
+    else if (p->pending == 0x4B && !p->rxbusy && !p->fphase)
+    { // Async poll with nobody waiting, abort it and take over the mutex
+      p->pending = 0;
+      p->aborted = 1; // Owner's pn532_Cards returns PN532_ERR_ABORTED
+      took = 1;
+    }
+  }
+  portEXIT_CRITICAL(&p->lock);
+  if (took)
+    uart_abort(p);
+  else if (p->abort && p->queue)
+  { // Wake the waiter now rather than at its next event
+    uart_event_t e = {.type = UART_EVENT_MAX};
+    xQueueSend(p->queue, &e, 0);
+  }
+  return took;
+}
+
+static int pn532_wake_mutex(pn532_t *p);
+
+static int pn532_lock(pn532_t *p, pn532_prio_t prio)
+{ // Take the DX mutex, high priority goes ahead of low priority at the next frame boundary
+  int64_t start = esp_timer_get_time();
+  int busy = 0;
+  if (prio == PN532_PRIO_HIGH)
+  {
+    portENTER_CRITICAL(&p->lock);
+    p->hiwait++;
+    portEXIT_CRITICAL(&p->lock);
+    while (1)
+    {
+      if (xSemaphoreTake(p->mutex, 0) == pdTRUE)
+        break;
+      if (pn532_preempt(p))
+      {
+        p->qstats[prio].aborts++;
+        break;
+      }
+      if ((busy = (p->fphase != PN532_POLL_IDLE)))
+        break;
+      if (xSemaphoreTake(p->mutex, 1) == pdTRUE)
+        break;
+    }
+    portENTER_CRITICAL(&p->lock);
+    p->hiwait--;
+    p->abort = 0;
+    portEXIT_CRITICAL(&p->lock);
+  }
+  else
+    while (1)
+    {
+      if (xSemaphoreTake(p->mutex, 1) != pdTRUE)
+      {
+        if ((busy = (p->fphase != PN532_POLL_IDLE)))
+          break;
+        continue;
+      }
+      if (!p->hiwait)
+        break;
+      xSemaphoreGive(p->mutex); // Let high priority go first
+      vTaskDelay(1);
+    }
+  if (busy)
+    return -(p->lasterr = PN532_ERR_CMDPENDING); // Non-blocking command has it until pn532_collect, perhaps from this same loop, so do not wait
+  p->prio = prio;
+  uint32_t us = esp_timer_get_time() - start;
+  pn532_qstats_t *q = &p->qstats[prio];
+  q->count++;
+  q->total_us += us;
+  if (us > q->max_us)
+    q->max_us = us;
+  if (p->rfails >= PN532_WAKE_AFTER)
+    pn532_wake_mutex(p); // Frames keep failing (polls, exchanges or commands), wake and set up again first
+  return 0;
+}
+
+// Recovery
+static int pn532_recoverable(int e)
+{ // Errors from a lost or corrupt frame, where the PN532 may be out of step with us
+  switch (e)
+  {
+  case PN532_ERR_TIMEOUT:
+  case PN532_ERR_TIMEOUTACK:
+  case PN532_ERR_BADACK:
+  case PN532_ERR_NACK:
+  case PN532_ERR_HEADER:
+  case PN532_ERR_CMDMISMATCH:
+  case PN532_ERR_SPACE:
+  case PN532_ERR_CHECKSUM:
+  case PN532_ERR_POSTAMBLE:
+    return 1;
+  }
+  return 0;
+}
+
+static void pn532_resync(pn532_t *p)
+{ // Abort whatever the PN532 is doing, and drop anything it sends until it goes quiet (or the time is up)
+  uart_abort(p);
+  uint8_t buf[16];
+  int64_t end = esp_timer_get_time() + PN532_RESYNC_MS * 1000LL;
+  int quiet = 0;
+  while (!(quiet = (uart_rx(p, buf, sizeof(buf), 5) <= 0)) && esp_timer_get_time() < end)
+    ;
+  p->recovery.resyncs++;
+  if (!quiet)
+    p->recovery.badresyncs++; // Line still busy, counts as another failure
+  if (!quiet && p->rfails < 0xFF)
+    p->rfails++;
+}
+
+static void pn532_failed(pn532_t *p, int l)
+{ // Count frames failing in a row, resync after a lost or corrupt one
+  if (l >= 0 || !pn532_recoverable(-l))
+    return;
+  if (p->rfails < 0xFF)
+    p->rfails++;
+  pn532_resync(p);
+}
+
+static void pn532_lp_state(pn532_t *p, uint8_t down)
+{ // Change power state, adding up time in each
+  int64_t now = esp_timer_get_time();
+  if (p->lpsince)
+  {
+    if (p->lpdown)
+      p->lpstats.down_us += now - p->lpsince;
+    else
+      p->lpstats.up_us += now - p->lpsince;
+  }
+  p->lpsince = now;
+  p->lpdown = down;
+}
+
+static void uart_wakeup(pn532_t *p)
+{ // Wake PN532 from power down / low Vbat
+  uint8_t buf[30] = {0};
+  int e = sizeof(buf);
+  buf[--e] = 0x55; // Idle
+  buf[--e] = 0x55;
+  buf[--e] = 0x55;
+  uart_flush_input(p->uart);
+  uart_tx(p, buf, sizeof(buf));
+  uart_wait_tx_done(p->uart, 100 / portTICK_PERIOD_MS);
+}
+
+int pn532_tx_mutex(pn532_t *p, uint8_t cmd, int len1, uint8_t *data1, int len2, uint8_t *data2);
+int pn532_rx_mutex(pn532_t *p, int max1, uint8_t *data1, int max2, uint8_t *data2, int ms);
+
+static int pn532_try(pn532_t *p, uint8_t held, uint8_t cmd, int len, uint8_t *data, int max, uint8_t *res, int ms)
+{ // Command and response, no retries, held if the caller has the mutex already
+  int l = (held ? pn532_tx_mutex(p, cmd, 0, NULL, len, data) : pn532_tx(p, cmd, 0, NULL, len, data));
+  if (l >= 0)
+    l = (held ? pn532_rx_mutex(p, 0, NULL, max, res, ms) : pn532_rx(p, 0, NULL, max, res, ms));
+  return l;
+}
+
+static int pn532_cmd_held(pn532_t *p, uint8_t held, uint8_t cmd, int len, uint8_t *data, int max, uint8_t *res, int ms)
+{ // Idempotent command and response, retried with backoff
+  uint32_t wakes = p->recovery.wakes;
+  int l,
+      tries = 0;
+  while (1)
+  {
+    l = pn532_try(p, held, cmd, len, data, max, res, ms);
+    if (l >= 0 || !pn532_recoverable(-l) || tries >= PN532_RETRIES)
+      break;
+    vTaskDelay(((5 << tries) + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS); // 5, 10, 20ms
+    tries++;
+    p->recovery.retries++;
+  }
+  if (l < 0 && pn532_recoverable(-l) && !held && (p->rfails >= PN532_WAKE_AFTER || p->recovery.wakes != wakes))
+    l = pn532_try(p, 0, cmd, len, data, max, res, ms); // Last go, waking first if not done already
+  if (l < 0)
+  {
+    p->recovery.failures++;
+    return l;
+  }
+  if (tries)
+    p->recovery.recovered++;
+  return l;
+}
+
+static int pn532_cmd(pn532_t *p, uint8_t cmd, int len, uint8_t *data, int max, uint8_t *res, int ms)
+{ // Idempotent command and response, retried with backoff
+  return pn532_cmd_held(p, 0, cmd, len, data, max, res, ms);
+}
+
+static int pn532_rf_send(pn532_t *p, uint8_t held, pn532_rf_profile_t profile);
+
+static int pn532_restore(pn532_t *p, uint8_t what)
+{ // Send host owned registers and/or RF profile again, mutex held
+  uint8_t buf[PN532_SHADOW * 3],
+      res[1];
+  int n = 0,
+      l = 0;
+  for (int i = 0; (what & PN532_LP_RESTORE_REGS) && i < p->nshadow; i++)
+  {
+    buf[n++] = p->shadow[i].addr >> 8;
+    buf[n++] = p->shadow[i].addr;
+    buf[n++] = p->shadow[i].val;
+  }
+  if (n)
+    l = pn532_cmd_held(p, 1, 0x08, n, buf, sizeof(res), res, 50);
+  if (l >= 0 && (what & PN532_LP_RESTORE_RF) && p->rfprofile < PN532_RF_MAX)
+    l = pn532_rf_send(p, 1, p->rfprofile);
+  return l;
+}
+
+static int pn532_wake_mutex(pn532_t *p)
+{ // Wake and set up again after repeated failure, mutex held so nobody else's exchange is cut short
+  p->recovery.wakes++;
+  uart_wakeup(p);
+  pn532_lp_state(p, 0);
+  uint8_t buf[3],
+      res[1];
+  int n = 0;
+  // SAMConfiguration
+  buf[n++] = 0x01; // Normal
+  buf[n++] = 20;   // *50ms timeout
+  buf[n++] = 0x00; // Not use IRQ
+  int l = pn532_cmd_held(p, 1, 0x14, n, buf, sizeof(res), res, 50);
+  if (l >= 0)
+    l = pn532_restore(p, PN532_LP_RESTORE_REGS | PN532_LP_RESTORE_RF);
+  p->rfails = 0;
+  if (l < 0)
+    ESP_LOGE(TAG, "Wake failed %s", pn532_err_to_name(pn532_lasterr(p)));
+  return l;
+}
+
+int pn532_recovery(pn532_t *p, pn532_recovery_t *r)
+{
+  if (!p)
+    return -PN532_ERR_NULL;
+  if (!r)
+    return -(p->lasterr = PN532_ERR_SPACE);
+  *r = p->recovery;
+  return 0;
+}
+
+// Register access
+static int pn532_shadow_find(pn532_t *p, uint16_t addr)
+{ // Index in shadow, or -1
+  for (int i = 0; i < p->nshadow; i++)
+    if (p->shadow[i].addr == addr)
+      return i;
+  return -1;
+}
+
+static int pn532_shadow_get(pn532_t *p, uint16_t addr, uint8_t *val)
+{ // Get host owned register, queued write first, else shadow, returns 1 if found
+  portENTER_CRITICAL(&p->lock);
+  int found = 0;
+  for (int q = 0; q < p->nregq && !found; q++)
+    if (p->regq[q].addr == addr)
+    {
+      *val = p->regq[q].val;
+      found = 1;
+    }
+  int i = (found ? -1 : pn532_shadow_find(p, addr));
+  if (i >= 0)
+  {
+    *val = p->shadow[i].val;
+    found = 1;
+  }
+  portEXIT_CRITICAL(&p->lock);
+  return found;
+}
+
+static void pn532_shadow_set(pn532_t *p, uint16_t addr, uint8_t val)
+{ // Record register written, only SFRs (0xFFxx) - CIU registers may change under us
+  if (addr < 0xFF00)
+    return;
+  int i = pn532_shadow_find(p, addr);
+  if (i < 0 && p->nshadow < PN532_SHADOW)
+    i = p->nshadow++;
+  if (i >= 0)
+    p->shadow[i] = (pn532_reg_t){addr, val};
+}
+
+static void pn532_fregs_add(pn532_t *p, uint16_t addr, uint8_t val, int *room)
+{ // Note SFR written by a non-blocking command, and drop queued writes to it (older, so replaced)
+  int i;
+  for (i = 0; i < p->nregq && p->regq[i].addr != addr; i++)
+    ;
+  if (i < p->nregq)
+    memmove(p->regq + i, p->regq + i + 1, (--p->nregq - i) * sizeof(*p->regq));
+  if (addr < 0xFF00)
+    return; // Not held in shadow
+  for (i = 0; i < p->nfregs && p->fregs[i].addr != addr; i++)
+    ;
+  if (i == p->nfregs)
+  { // New entry, only if in shadow or the shadow has room for it, so fregs cannot overflow
+    if (pn532_shadow_find(p, addr) < 0 && (*room)-- <= 0)
+      return;
+    p->nfregs++;
+  }
+  p->fregs[i] = (pn532_reg_t){addr, val};
+}
+
+static void pn532_fregs_start(pn532_t *p, uint8_t cmd, int len1, uint8_t *data1, int len2, uint8_t *data2)
+{ // Non-blocking command starting, note what WriteGPIO or WriteRegister changes
+  int len = len1 + len2,
+      room = PN532_SHADOW - p->nshadow;
+#define b(n) ((n) < len1 ? data1[n] : data2[(n) - len1])
+  portENTER_CRITICAL(&p->lock);
+  p->nfregs = 0;
+  if (cmd == 0x0E)
+  { // WriteGPIO, P3 and P7 with validation bit
+    if (len >= 1 && (b(0) & 0x80))
+      pn532_fregs_add(p, PN532_REG_P3, 0xC0 | (b(0) & 0x3F), &room);
+    if (len >= 2 && (b(1) & 0x80))
+      pn532_fregs_add(p, PN532_REG_P7, 0xF9 | (b(1) & 0x06), &room);
+  }
+  else if (cmd == 0x08)
+    for (int i = 0; i + 2 < len; i += 3)
+      pn532_fregs_add(p, (b(i) << 8) + b(i + 1), b(i + 2), &room);
+#undef b
+  portEXIT_CRITICAL(&p->lock);
+}
+
+static void pn532_fregs_end(pn532_t *p, int ok)
+{ // Non-blocking command done, shadow now holds what it wrote, or on failure the registers are not known
+  portENTER_CRITICAL(&p->lock);
+  for (int i = 0; i < p->nfregs; i++)
+    if (ok)
+      pn532_shadow_set(p, p->fregs[i].addr, p->fregs[i].val);
+    else
+    {
+      int s = pn532_shadow_find(p, p->fregs[i].addr);
+      if (s >= 0) // Read from the PN532 again, and not restored
+        memmove(p->shadow + s, p->shadow + s + 1, (--p->nshadow - s) * sizeof(*p->shadow));
+    }
+  p->nfregs = 0;
+  portEXIT_CRITICAL(&p->lock);
+}
+
+static int pn532_reg_add(pn532_t *p, uint16_t addr, uint8_t val)
+{ // Add to queued register writes, flushing if full, returns 0 or -ve for error
+  for (;;)
+  {
+    int added = 1;
+    portENTER_CRITICAL(&p->lock);
+    int i;
+    for (i = 0; i < p->nregq && p->regq[i].addr != addr; i++)
+      ;
+    if (i < p->nregq)
+      p->regq[i].val = val; // Replace queued value
+    else
+    {
+      int s = pn532_shadow_find(p, addr);
+      if (s >= 0 && p->shadow[s].val == val)
+        ; // Changes nothing
+      else if (p->nregq < PN532_REGQ)
+      {
+        if (!p->nregq)
+          p->regqtime = esp_timer_get_time();
+        p->regq[p->nregq++] = (pn532_reg_t){addr, val};
+      }
+      else
+        added = 0; // Full (another task got in first), flush and try again
+    }
+    int full = (p->nregq == PN532_REGQ);
+    portEXIT_CRITICAL(&p->lock);
+    if (added && !full)
+      return 0;
+    int l = pn532_flush_registers(p);
+    if (l < 0)
+      return l; // Still queued, and this write not added if it did not fit
+    if (added)
+      return 0;
+  }
+}
+
+static int pn532_reg_due(pn532_t *p)
+{ // Flush queued register writes if window has passed, not while a non-blocking command has the reader
+  if (p->nregq && !p->fphase && esp_timer_get_time() - p->regqtime >= p->regwindow * 1000LL)
+    return pn532_flush_registers(p);
+  return 0;
+}
+
+int pn532_flush_registers(pn532_t *p)
+{
+  if (!p)
+    return -PN532_ERR_NULL;
+  pn532_reg_t q[PN532_REGQ];
+  uint8_t buf[PN532_REGQ * 3];
+  int n = 0,
+      l = 0;
+  portENTER_CRITICAL(&p->lock);
+  for (int i = 0; i < p->nregq; i++)
+  {
+    int s = pn532_shadow_find(p, p->regq[i].addr);
+    if (s >= 0 && p->shadow[s].val == p->regq[i].val)
+      continue; // Set back to what it was
+    q[n++] = p->regq[i];
+  }
+  portEXIT_CRITICAL(&p->lock);
+  if (n)
+  {
+    for (int i = 0; i < n; i++)
+    {
+      buf[l++] = q[i].addr >> 8;
+      buf[l++] = q[i].addr;
+      buf[l++] = q[i].val;
+    }
+    uint8_t res[1];
+    l = pn532_cmd(p, 0x08, l, buf, sizeof(res), res, 50);
+    if (l < 0)
+      return l; // Left queued, sent again when next due
+  }
+  portENTER_CRITICAL(&p->lock);
+  for (int i = 0; i < n; i++)
+    pn532_shadow_set(p, q[i].addr, q[i].val);
+  int k = 0;
+  for (int i = 0; i < p->nregq; i++)
+  { // Drop what was sent or is in the shadow, keep anything changed since
+    int s = pn532_shadow_find(p, p->regq[i].addr),
+        j;
+    for (j = 0; j < n && (q[j].addr != p->regq[i].addr || q[j].val != p->regq[i].val); j++)
+      ;
+    if (j == n && (s < 0 || p->shadow[s].val != p->regq[i].val))
+      p->regq[k++] = p->regq[i];
+  }
+  p->nregq = k;
+  portEXIT_CRITICAL(&p->lock);
+  return 0;
+}
+
+int pn532_queue_register(pn532_t *p, uint16_t addr, uint8_t val)
+{
+  if (!p)
+    return -PN532_ERR_NULL;
+  int l = pn532_reg_add(p, addr, val);
+  if (l >= 0)
+    l = pn532_reg_due(p);
+  return l;
+}
+
+int pn532_write_register(pn532_t *p, uint16_t addr, uint8_t val)
+{
+  if (!p)
+    return -PN532_ERR_NULL;
+  int l = pn532_reg_add(p, addr, val);
+  if (l >= 0)
+    l = pn532_flush_registers(p);
+  return l;
+}
+
+void pn532_register_window(pn532_t *p, int ms)
+{
+  if (!p)
+    return;
+  if (ms < 0)
+    ms = 0;
+  if (ms > 0xFFFF)
+    ms = 0xFFFF;
+  p->regwindow = ms;
+}
+
+int pn532_read_registers(pn532_t *p, int n, const uint16_t *addr, uint8_t *val)
+{ // Read registers, host owned ones from shadow, the rest in one ReadRegister
+  if (!p)
+    return -PN532_ERR_NULL;
+  if (n < 0 || n > 32)
+    return -(p->lasterr = PN532_ERR_SPACE);
+  uint8_t buf[64],
+      map[32];
+  int m = 0;
+  for (int i = 0; i < n; i++)
+    if (!pn532_shadow_get(p, addr[i], &val[i]))
+    { // Need to ask
+      buf[m * 2] = addr[i] >> 8;
+      buf[m * 2 + 1] = addr[i];
+      map[m++] = i;
+    }
+  if (!m)
+    return n;
+  uint8_t res[32];
+  int l = pn532_cmd(p, 0x06, m * 2, buf, sizeof(res), res, 50);
+  if (l < 0)
+    return l;
+  if (l < m)
+    return -(p->lasterr = PN532_ERR_SHORT);
+  for (int i = 0; i < m; i++)
+    val[map[i]] = res[i];
+  return n;
+}
+
+int pn532_read_register(pn532_t *p, uint16_t addr)
+{
+  uint8_t val;
+  int l = pn532_read_registers(p, 1, &addr, &val);
+  if (l < 0)
+    return l;
+  return val;
+}
+
+int pn532_qstats(pn532_t *p, pn532_prio_t prio, pn532_qstats_t *q)
+{
+  if (!p)
+    return -PN532_ERR_NULL;
+  if (prio >= PN532_PRIO_MAX || !q)
+    return -(p->lasterr = PN532_ERR_SPACE);
+  *q = p->qstats[prio];
+  return 0;
+}
+
+void pn532_qstats_reset(pn532_t *p)
+{
+  if (p)
+    memset(p->qstats, 0, sizeof(p->qstats));
+}
+
 void *pn532_end(pn532_t *p)
 {
   if (p)
   {
     vSemaphoreDelete(p->mutex);
-    free(p);
+    if (!p->isstatic)
+      free(p);
   }
   return NULL;
 }
@@ -142,18 +870,42 @@ int pn532_deinit(pn532_t *p)
   return 0;
 }
 
-pn532_t *pn532_init(int8_t uart, uint8_t baud, int8_t tx, int8_t rx, uint8_t outputs)
-{ // Init PN532 (baud is 0-8 for 9600-1288000
+static int pn532_init_args(int8_t uart, int8_t tx, int8_t rx)
+{ // Check init args
   if (uart < 0 || tx < 0 || rx < 0 || tx == rx)
-    return NULL;
+    return 0;
   if (!GPIO_IS_VALID_OUTPUT_GPIO(tx) || !GPIO_IS_VALID_GPIO(rx))
+    return 0;
+  return 1;
+}
+
+static pn532_t *pn532_setup(pn532_t *p, uint8_t isstatic, int8_t uart, uint8_t baud, int8_t tx, int8_t rx, uint8_t outputs);
+
+pn532_t *pn532_init(int8_t uart, uint8_t baud, int8_t tx, int8_t rx, uint8_t outputs)
+{ // Init PN532 (baud is 0-8 for 9600-1288000
+  if (!pn532_init_args(uart, tx, rx))
     return NULL;
   pn532_t *p = malloc(sizeof(*p));
   if (!p)
     return p;
+  return pn532_setup(p, 0, uart, baud, tx, rx, outputs);
+}
+
+pn532_t *pn532_init_static(pn532_static_t *mem, int8_t uart, uint8_t baud, int8_t tx, int8_t rx, uint8_t outputs)
+{ // Init PN532 in caller provided storage, no heap used by this driver
+  if (!mem || !pn532_init_args(uart, tx, rx))
+    return NULL;
+  return pn532_setup((pn532_t *)mem, 1, uart, baud, tx, rx, outputs);
+}
+
+static pn532_t *pn532_setup(pn532_t *p, uint8_t isstatic, int8_t uart, uint8_t baud, int8_t tx, int8_t rx, uint8_t outputs)
+{ // Set up PN532 in allocated storage
   memset(p, 0, sizeof(*p));
+  p->isstatic = isstatic;
   p->uart = uart;
-  p->mutex = xSemaphoreCreateBinary();
+  portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+  p->lock = lock;
+  p->mutex = xSemaphoreCreateBinaryStatic(&p->mutexbuf);
   xSemaphoreGive(p->mutex);
   esp_err_t err = 0;
   { // Init UART
@@ -176,7 +928,9 @@ pn532_t *pn532_init(int8_t uart, uint8_t baud, int8_t tx, int8_t rx, uint8_t out
     if (!err && !uart_is_driver_installed(uart))
     {
       ESP_LOGI(TAG, "Installing UART driver %d", uart);
-      err = uart_driver_install(uart, RX_BUF, TX_BUF, 0, NULL, 0);
+      err = uart_driver_install(uart, RX_BUF, TX_BUF, PN532_EVENTS, PN532_EVENTS ? &p->queue : NULL, 0);
+      if (!err && p->queue)
+        err = uart_set_rx_timeout(uart, PN532_RX_TOUT); // Event soon after a frame ends
     }
     if (err)
     {
@@ -187,14 +941,10 @@ pn532_t *pn532_init(int8_t uart, uint8_t baud, int8_t tx, int8_t rx, uint8_t out
   ESP_LOGD(TAG, "UART %d Tx %d Rx %d", uart, tx, rx);
   gpio_set_drive_capability(tx, GPIO_DRIVE_CAP_3); // Oomph?
   int n;
-  uint8_t buf[30] = {0};
-  int e = sizeof(buf);
-  buf[--e] = 0x55; // Idle
-  buf[--e] = 0x55;
-  buf[--e] = 0x55;
-  uart_flush_input(p->uart);
-  uart_tx(p, buf, sizeof(buf));
-  uart_wait_tx_done(p->uart, 100 / portTICK_PERIOD_MS);
+  uint8_t buf[30],
+      res[4];
+  p->rfprofile = PN532_RF_MAX; // Nothing set yet, so nothing to restore if woken
+  uart_wakeup(p);
   if (baud != 4 && baud <= 8)
   { // Not the default Baud rate, go through the change of Baud rate step by step
     if (pn532_tx(p, 0x10, 1, &baud, 0, NULL) < 0 || pn532_rx(p, 0, NULL, sizeof(buf), buf, 20) < 0)
@@ -233,84 +983,39 @@ pn532_t *pn532_init(int8_t uart, uint8_t baud, int8_t tx, int8_t rx, uint8_t out
   buf[n++] = 0x01; // Normal
   buf[n++] = 20;   // *50ms timeout
   buf[n++] = 0x00; // Not use IRQ
-  if (pn532_tx(p, 0x14, 0, NULL, n, buf) < 0 || pn532_rx(p, 0, NULL, sizeof(buf), buf, 50) < 0)
-  {                                    // Again
-    uart_rx(p, buf, sizeof(buf), 100); // Wait long enough for command response timeout before we try again
-    // SAMConfiguration
-    n = 0;
-    buf[n++] = 0x01; // Normal
-    buf[n++] = 20;   // *50ms timeout
-    buf[n++] = 0x00; // Not use IRQ
-    if (pn532_tx(p, 0x14, 0, NULL, n, buf) < 0 || pn532_rx(p, 0, NULL, sizeof(buf), buf, 50) < 0)
-    {
-      ESP_LOGE(TAG, "SAMConfiguration fail %s", pn532_err_to_name(pn532_lasterr(p)));
-      return pn532_end(p);
-    }
+  if (pn532_cmd(p, 0x14, n, buf, sizeof(res), res, 50) < 0)
+  { // Retried with resync if first attempt lost
+    ESP_LOGE(TAG, "SAMConfiguration fail %s", pn532_err_to_name(pn532_lasterr(p)));
+    return pn532_end(p);
   }
   // GetFirmwareVersion
-  if (pn532_tx(p, 0x02, 0, NULL, 0, NULL) < 0 || pn532_rx(p, 0, NULL, sizeof(buf), buf, 50) < 0)
+  if (pn532_cmd(p, 0x02, 0, NULL, sizeof(res), res, 50) < 0)
   {
     ESP_LOGE(TAG, "GetFirmwareVersion fail %s", pn532_err_to_name(pn532_lasterr(p)));
     return pn532_end(p);
   }
   // uint32_t ver = (buf[0] << 24) + (buf[1] << 16) + (buf[2] << 8) + buf[3];
-  //  RFConfiguration (retries)
-  n = 0;
-  buf[n++] = 5;    // Config item 5 (MaxRetries)
-  buf[n++] = 0xFF; // MxRtyATR (default = 0xFF)
-  buf[n++] = 0x01; // MxRtyPSL (default = 0x01)
-  buf[n++] = 0x01; // MxRtyPassiveActivation
-  if (pn532_tx(p, 0x32, 0, NULL, n, buf) < 0 || pn532_rx(p, 0, NULL, sizeof(buf), buf, 50) < 0)
+  //  RFConfiguration (retries, timings)
+  if (pn532_rf_profile(p, PN532_RF_INIT) < 0)
   {
     ESP_LOGE(TAG, "RFConfiguration fail %s", pn532_err_to_name(pn532_lasterr(p)));
     return pn532_end(p);
   }
   // WriteRegister
-  n = 0;
   // AB are 00=open drain, 10=quasi bidi, 01=input (high imp), 11=output (push/pull)
-  buf[n++] = 0xFF;                    // P3CFGA
-  buf[n++] = 0xFC;                    // P3CFGA
-  buf[n++] = (outputs & 0x3F);        // Define output bits
-  buf[n++] = 0xFF;                    // P3CFGB
-  buf[n++] = 0xFD;                    // P3CFGB
-  buf[n++] = 0xFF;                    // 0xFF
-  buf[n++] = 0xFF;                    // P3
-  buf[n++] = 0xB0;                    // P3
-  buf[n++] = 0xFF;                    // All high
-  buf[n++] = 0xFF;                    // P7CFGA
-  buf[n++] = 0xF4;                    // P7CFGA
-  buf[n++] = ((outputs >> 5) & 0x06); // Define output bits
-  buf[n++] = 0xFF;                    // P7CFGB
-  buf[n++] = 0xF5;                    // P7CFGB
-  buf[n++] = 0xFF;                    // 0xFF
-  buf[n++] = 0xFF;                    // P7
-  buf[n++] = 0xF7;                    // P7
-  buf[n++] = 0xFF;                    // All high
-  if (n && (pn532_tx(p, 0x08, 0, NULL, n, buf) < 0 || pn532_rx(p, 0, NULL, sizeof(buf), buf, 50) < 0))
+  p->outputs = outputs;
+  pn532_reg_add(p, PN532_REG_P3CFGA, outputs & 0x3F); // Define output bits
+  pn532_reg_add(p, PN532_REG_P3CFGB, 0xFF);
+  pn532_reg_add(p, PN532_REG_P3, 0xFF); // All high
+  pn532_reg_add(p, PN532_REG_P7CFGA, (outputs >> 5) & 0x06); // Define output bits
+  pn532_reg_add(p, PN532_REG_P7CFGB, 0xFF);
+  pn532_reg_add(p, PN532_REG_P7, 0xFF); // All high
+  if (pn532_flush_registers(p) < 0)
   {
     ESP_LOGE(TAG, "WriteRegister fail %s", pn532_err_to_name(pn532_lasterr(p)));
     return pn532_end(p);
   }
-  // RFConfiguration
-  n = 0;
-  buf[n++] = 0x04; // MaxRtyCOM
-  buf[n++] = 1;    // Retries (default 0)
-  if (pn532_tx(p, 0x32, 0, NULL, n, buf) < 0 || pn532_rx(p, 0, NULL, sizeof(buf), buf, 50) < 0)
-  {
-    ESP_LOGE(TAG, "RFConfiguration fail %s", pn532_err_to_name(pn532_lasterr(p)));
-    return pn532_end(p);
-  }
-  // RFConfiguration
-  n = 0;
-  buf[n++] = 0x02; // Various timings (100*2^(n-1))us
-  buf[n++] = 0x00; // RFU
-  buf[n++] = 0x0B; // Default (102.4 ms)
-  buf[n++] = 0x0A; // Default is 0x0A (51.2 ms)
-  if (pn532_tx(p, 0x32, 0, NULL, n, buf) < 0 || pn532_rx(p, 0, NULL, sizeof(buf), buf, 50) < 0)
-  {
-    ESP_LOGE(TAG, "RFConfiguration fail %s", pn532_err_to_name(pn532_lasterr(p)));
-    return pn532_end(p);
-  }
+  pn532_lp_state(p, 0);
   return p;
 }
 
@@ -338,10 +1043,8 @@ uint8_t *pn532_nfcid(pn532_t *p, char text[21])
 }
 
 // Low level access functions
-int pn532_tx_mutex(pn532_t *p, uint8_t cmd, int len1, uint8_t *data1, int len2, uint8_t *data2)
-{ // Send data to PN532
-  if (p->pending)
-    return -(p->lasterr = PN532_ERR_CMDPENDING);
+static void pn532_frame_tx(pn532_t *p, uint8_t cmd, int len1, uint8_t *data1, int len2, uint8_t *data2)
+{ // Send command frame
   uint8_t buf[20],
       *b = buf;
   *b++ = 0x55;
@@ -381,11 +1084,28 @@ int pn532_tx_mutex(pn532_t *p, uint8_t cmd, int len1, uint8_t *data1, int len2,
   buf[0] = -sum; // Checksum
   buf[1] = 0x00; // Postamble
   uart_tx(p, buf, 2);
-  uart_wait_tx_done(p->uart, 1000 / portTICK_PERIOD_MS);
-  // Get ACK and check it
-  l = uart_preamble(p, 50);
-  if (l < 2)
-    return -(p->lasterr = PN532_ERR_TIMEOUTACK);
+}
+
+static int pn532_tx_ack(pn532_t *p, uint8_t cmd, int len)
+{ // Wait for ACK of command frame just sent, returns len
+  uint8_t buf[3];
+  if (p->queue)
+  { // Get ACK from frame parser
+    pn532_frame_rx(p, cmd + 1, 0, NULL, 0, NULL);
+    int r = uart_event_wait(p, 50);
+    if (r == -PN532_ERR_TIMEOUT)
+      return -(p->lasterr = PN532_ERR_TIMEOUTACK);
+    if (r == -PN532_ERR_NACK)
+      return -(p->lasterr = PN532_ERR_NACK);
+    if (r != 1)
+      return -(p->lasterr = PN532_ERR_BADACK);
+    p->pending = cmd + 1;
+    return len;
+  }
+  // Get ACK and check it
+  int l = uart_preamble(p, 50);
+  if (l < 2)
+    return -(p->lasterr = PN532_ERR_TIMEOUTACK);
   l = uart_rx(p, buf, 3, 10);
   if (l < 3)
     return -(p->lasterr = PN532_ERR_TIMEOUTACK);
@@ -396,43 +1116,111 @@ int pn532_tx_mutex(pn532_t *p, uint8_t cmd, int len1, uint8_t *data1, int len2,
   if (buf[0] || buf[1] != 0xFF)
     return -(p->lasterr = PN532_ERR_BADACK); // Bad
   p->pending = cmd + 1;
-  return len1 + len2;
+  return len;
+}
+
+static int pn532_tx_frame(pn532_t *p, uint8_t cmd, int len1, uint8_t *data1, int len2, uint8_t *data2)
+{ // Send data to PN532
+  if (p->pending)
+    return -(p->lasterr = PN532_ERR_CMDPENDING);
+  if (p->queue)
+    xQueueReset(p->queue); // Events from before this command
+  pn532_frame_tx(p, cmd, len1, data1, len2, data2);
+  uart_wait_tx_done(p->uart, 1000 / portTICK_PERIOD_MS);
+  return pn532_tx_ack(p, cmd, len1 + len2);
+}
+
+static void pn532_tx_raw(pn532_t *p, const uint8_t *frame, int len)
+{ // Send a pre-built command frame in one go, pn532_tx_ack to follow
+  if (p->queue)
+    xQueueReset(p->queue);
+  uart_flush_input(p->uart);
+  uart_tx(p, frame, len);
+  uart_wait_tx_done(p->uart, 1000 / portTICK_PERIOD_MS);
+}
+
+int pn532_tx_mutex(pn532_t *p, uint8_t cmd, int len1, uint8_t *data1, int len2, uint8_t *data2)
+{ // Send data to PN532, resync if ACK lost or corrupt
+  int l = pn532_tx_frame(p, cmd, len1, data1, len2, data2);
+  pn532_failed(p, l);
+  return l;
 }
 
 int pn532_tx(pn532_t *p, uint8_t cmd, int len1, uint8_t *data1, int len2, uint8_t *data2)
 { // Send data to PN532
+  return pn532_tx_prio(p, pn532_cmd_prio(cmd), cmd, len1, data1, len2, data2);
+}
+
+int pn532_tx_prio(pn532_t *p, pn532_prio_t prio, uint8_t cmd, int len1, uint8_t *data1, int len2, uint8_t *data2)
+{ // Send data to PN532 in a given scheduling class
   if (!p)
     return -PN532_ERR_NULL;
-#ifdef CONFIG_PN532_DEBUG_MSG
-  { // Messy
-    uint8_t buf[100],
-        *p = buf;
-    *p++ = cmd;
-    if (len1)
-    {
-      memcpy(p, data1, len1);
-      p += len1;
-    }
-    if (len2)
-    {
-      memcpy(p, data2, len2);
-      p += len2;
-    }
-    ESP_LOG_BUFFER_HEX_LEVEL("NFCTx", buf, (int)(p - buf), MSGLOG);
+  if (prio >= PN532_PRIO_MAX)
+    prio = PN532_PRIO_LOW;
+  if (p->fphase)
+    return -(p->lasterr = PN532_ERR_CMDPENDING); // Non-blocking command holds the mutex until pn532_collect
+  if (p->lpdown)
+  { // Wake first, giving up if that fails
+    int l = pn532_resume(p);
+    if (l < 0)
+      return l;
   }
+  if (p->nregq && cmd != 0x08)
+    pn532_reg_due(p); // Send queued register writes whose window has passed
+#ifdef CONFIG_PN532_DEBUG_MSG
+  ESP_LOG_LEVEL(MSGLOG, "NFCTx", "%02X", cmd);
+  if (len1)
+    ESP_LOG_BUFFER_HEX_LEVEL("NFCTx", data1, len1, MSGLOG);
+  if (len2)
+    ESP_LOG_BUFFER_HEX_LEVEL("NFCTx", data2, len2, MSGLOG);
 #endif
-  xSemaphoreTake(p->mutex, portMAX_DELAY);
-  int l = pn532_tx_mutex(p, cmd, len1, data1, len2, data2);
+  int l = pn532_lock(p, prio);
+  if (l < 0)
+    return l;
+  l = pn532_tx_mutex(p, cmd, len1, data1, len2, data2);
   if (!p->pending)
     xSemaphoreGive(p->mutex);
   return l;
 }
 
-int pn532_rx_mutex(pn532_t *p, int max1, uint8_t *data1, int max2, uint8_t *data2, int ms)
+static int pn532_aborted(pn532_t *p)
+{ // Give way to high priority command
+  uart_abort(p);
+  p->abort = 0;
+  p->qstats[PN532_PRIO_HIGH].aborts++;
+  return -(p->lasterr = PN532_ERR_ABORTED);
+}
+
+static int pn532_rx_event(pn532_t *p, uint8_t pending, int max1, uint8_t *data1, int max2, uint8_t *data2, int ms)
+{ // Recv data from PN532 via frame parser, woken by UART events
+  pn532_frame_rx(p, pending, max1, data1, max2, data2);
+  int r = uart_event_wait(p, ms);
+  if (r == -PN532_ERR_ABORTED)
+    return pn532_aborted(p);
+  if (r == 1)
+    return -(p->lasterr = PN532_ERR_BADACK); // ACK not response
+  if (r < 0)
+    return -(p->lasterr = -r);
+#ifdef CONFIG_PN532_DEBUG_MSG
+  ESP_LOG_LEVEL(MSGLOG, "NFCRx", "%02X", pending);
+  int len1 = (p->flen < p->fmax1 ? p->flen : p->fmax1);
+  if (len1)
+    ESP_LOG_BUFFER_HEX_LEVEL("NFCRx", data1, len1, MSGLOG);
+  if (p->flen > len1)
+    ESP_LOG_BUFFER_HEX_LEVEL("NFCRx", data2, p->flen - len1, MSGLOG);
+#endif
+  return p->flen;
+}
+
+static int pn532_rx_frame(pn532_t *p, int max1, uint8_t *data1, int max2, uint8_t *data2, int ms)
 { // Recv data from PN532
   uint8_t pending = p->pending;
   p->pending = 0;
+  if (p->queue)
+    return pn532_rx_event(p, pending, max1, data1, max2, data2, ms);
   int l = uart_preamble(p, ms);
+  if (l == -PN532_ERR_ABORTED)
+    return pn532_aborted(p);
   if (l < 2)
     return -(p->lasterr = PN532_ERR_TIMEOUT);
   uint8_t buf[9];
@@ -516,33 +1304,38 @@ int pn532_rx_mutex(pn532_t *p, int max1, uint8_t *data1, int max2, uint8_t *data
   if (buf[1])
     return -(p->lasterr = PN532_ERR_POSTAMBLE); // postamble
 #ifdef CONFIG_PN532_DEBUG_MSG
-  { // Messy
-    uint8_t buf[100],
-        *p = buf;
-    *p++ = pending;
-    if (len1)
-    {
-      memcpy(p, data1, len1);
-      p += len1;
-    }
-    if (len2)
-    {
-      memcpy(p, data2, len2);
-      p += len2;
-    }
-    ESP_LOG_BUFFER_HEX_LEVEL("NFCRx", buf, (int)(p - buf), MSGLOG);
-  }
+  ESP_LOG_LEVEL(MSGLOG, "NFCRx", "%02X", pending);
+  if (len1)
+    ESP_LOG_BUFFER_HEX_LEVEL("NFCRx", data1, len1, MSGLOG);
+  if (len2)
+    ESP_LOG_BUFFER_HEX_LEVEL("NFCRx", data2, len2, MSGLOG);
 #endif
   return res;
 }
 
+int pn532_rx_mutex(pn532_t *p, int max1, uint8_t *data1, int max2, uint8_t *data2, int ms)
+{ // Recv data from PN532, resync if response lost or corrupt so a late or partial frame is not taken as the next reply
+  int l = pn532_rx_frame(p, max1, data1, max2, data2, ms);
+  if (l >= 0)
+    p->rfails = 0; // Talking to us
+  pn532_failed(p, l);
+  return l;
+}
+
 int pn532_rx(pn532_t *p, int max1, uint8_t *data1, int max2, uint8_t *data2, int ms)
 { // Recv data from PN532
   if (!p)
     return -PN532_ERR_NULL;
-  if (!p->pending)
+  if (p->fphase)
+    return -(p->lasterr = PN532_ERR_CMDPENDING); // Non-blocking command in progress
+  portENTER_CRITICAL(&p->lock);
+  uint8_t pending = p->pending;
+  p->rxbusy = pending;
+  portEXIT_CRITICAL(&p->lock);
+  if (!pending)
     return -(p->lasterr = PN532_ERR_NOTPENDING);
   int l = pn532_rx_mutex(p, max1, data1, max2, data2, ms);
+  p->rxbusy = 0;
   xSemaphoreGive(p->mutex);
   return l;
 }
@@ -559,6 +1352,218 @@ int pn532_ready(pn532_t *p)
   return length;
 }
 
+// Non-blocking access
+static int pn532_feed(pn532_t *p, uint8_t c)
+{ // Frame parser, returns 0 for more needed, 1 for ACK, 2 for response complete, -ve for error
+  switch (p->fstate)
+  {
+  case PN532_F_PRE:
+    if (p->flast == 0x00 && c == 0xFF)
+      p->fstate = PN532_F_LEN;
+    p->flast = c;
+    return 0;
+  case PN532_F_LEN:
+    p->flen = c;
+    p->fstate = PN532_F_LCS;
+    return 0;
+  case PN532_F_LCS:
+    p->flast = 0xFF;
+    p->fstate = PN532_F_PRE;
+    if (!p->flen && c == 0xFF)
+      return 1; // ACK
+    if (p->flen == 0xFF && !c)
+      return -PN532_ERR_NACK;
+    if (p->flen == 0xFF && c == 0xFF)
+    { // Extended
+      p->fstate = PN532_F_XLENM;
+      return 0;
+    }
+    if ((uint8_t)(p->flen + c))
+      return -PN532_ERR_HEADER; // Bad checksum
+    p->fstate = PN532_F_TFI;
+    return 0;
+  case PN532_F_XLENM:
+    p->flen = (c << 8);
+    p->fstate = PN532_F_XLENL;
+    return 0;
+  case PN532_F_XLENL:
+    p->flen += c;
+    p->fstate = PN532_F_XLCS;
+    return 0;
+  case PN532_F_XLCS:
+    p->fstate = PN532_F_PRE;
+    if ((uint8_t)((p->flen >> 8) + p->flen + c))
+      return -PN532_ERR_HEADER; // Bad checksum
+    p->fstate = PN532_F_TFI;
+    return 0;
+  case PN532_F_TFI:
+    p->fstate = PN532_F_PRE;
+    if (c != 0xD5 || p->flen < 2)
+      return -PN532_ERR_HEADER; // Not reply (0x7F is error frame)
+    p->flen -= 2;
+    p->fsum = c;
+    p->fstate = PN532_F_CMD;
+    return 0;
+  case PN532_F_CMD:
+    p->fstate = PN532_F_PRE;
+    if (c != p->fcmd)
+      return -PN532_ERR_CMDMISMATCH; // Not right reply
+    p->fsum += c;
+    p->fpos = 0;
+    p->fstate = (p->flen ? PN532_F_DATA : PN532_F_DCS);
+    return 0;
+  case PN532_F_DATA:
+    if (p->fpos < p->fmax1)
+      p->fbuf1[p->fpos] = c;
+    else if (p->fpos - p->fmax1 < p->fmax2)
+      p->fbuf2[p->fpos - p->fmax1] = c;
+    p->fsum += c;
+    if (++p->fpos == p->flen)
+      p->fstate = PN532_F_DCS;
+    return 0;
+  case PN532_F_DCS:
+    p->fstate = PN532_F_PRE;
+    if ((uint8_t)(p->fsum + c))
+      return -PN532_ERR_CHECKSUM;
+    p->fstate = PN532_F_POST;
+    return 0;
+  case PN532_F_POST:
+    p->fstate = PN532_F_PRE;
+    if (c)
+      return -PN532_ERR_POSTAMBLE;
+    if (p->flen > p->fmax1 + p->fmax2)
+      return -PN532_ERR_SPACE; // Too big
+    return 2;
+  }
+  p->fstate = PN532_F_PRE;
+  return 0;
+}
+
+static void pn532_frame_end(pn532_t *p, int e)
+{ // Non-blocking command complete or failed
+  p->pending = 0;
+  if (p->nfregs)
+    pn532_fregs_end(p, !e);
+  if (e)
+  {
+    p->lasterr = e;
+    p->fphase = PN532_POLL_ERROR;
+    if (p->fack)
+    { // Chip may still be working on it
+      static const uint8_t ack[] = {0x00, 0x00, 0xFF, 0x00, 0xFF, 0x00};
+      uart_tx(p, ack, sizeof(ack));
+    }
+    if (pn532_recoverable(e))
+    { // Late or partial frame may follow, drop it before next command
+      p->fresync = 1;
+      p->recovery.resyncs++;
+      if (p->rfails < 0xFF)
+        p->rfails++; // Next blocking command wakes if these keep failing
+    }
+  }
+  else
+  {
+    p->fphase = PN532_POLL_COMPLETE;
+    p->rfails = 0;
+  }
+}
+
+int pn532_start(pn532_t *p, uint32_t now, int ms, uint8_t cmd, int len1, uint8_t *data1, int len2, uint8_t *data2)
+{ // Send command without waiting for anything
+  if (!p)
+    return -PN532_ERR_NULL;
+  if (p->lpdown)
+    return -(p->lasterr = PN532_ERR_ASLEEP); // Waking waits, pn532_resume first
+  if (len1 + len2 > PN532_FRAME)
+    return -(p->lasterr = PN532_ERR_SPACE); // Would not fit the UART TX buffer, so would wait
+  if (xSemaphoreTake(p->mutex, 0) != pdTRUE)
+    return -(p->lasterr = PN532_ERR_CMDPENDING);
+  if (p->pending || p->fphase)
+  {
+    xSemaphoreGive(p->mutex);
+    return -(p->lasterr = PN532_ERR_CMDPENDING);
+  }
+  p->prio = PN532_PRIO_LOW;
+  if (p->fresync)
+  {
+    uart_flush_input(p->uart);
+    p->fresync = 0;
+  }
+  pn532_fregs_start(p, cmd, len1, data1, len2, data2);
+  pn532_frame_tx(p, cmd, len1, data1, len2, data2);
+  pn532_frame_rx(p, cmd + 1, sizeof(p->frame), p->frame, 0, NULL);
+  p->fack = 0;
+  p->fstart = now;
+  p->fms = (ms > 0xFFFF ? 0xFFFF : ms);
+  p->pending = cmd + 1;
+  p->fphase = PN532_POLL_BUSY;
+  return len1 + len2;
+}
+
+pn532_poll_t pn532_poll(pn532_t *p, uint32_t now)
+{ // Advance non-blocking command using only bytes already received
+  if (!p)
+    return PN532_POLL_ERROR;
+  if (p->fphase != PN532_POLL_BUSY)
+    return p->fphase;
+  size_t n = 0;
+  uart_get_buffered_data_len(p->uart, &n);
+  while (n && p->fphase == PN532_POLL_BUSY)
+  {
+    uint8_t buf[16];
+    int l = uart_read_bytes(p->uart, buf, n < sizeof(buf) ? n : sizeof(buf), 0);
+    if (l <= 0)
+      break;
+#ifdef CONFIG_PN532_DUMP
+    ESP_LOG_BUFFER_HEX_LEVEL("NFCRx", buf, l, HEXLOG);
+#endif
+    n -= l;
+    for (int i = 0; i < l && p->fphase == PN532_POLL_BUSY; i++)
+    {
+      int r = pn532_feed(p, buf[i]);
+      if (r == 1 && !p->fack)
+        p->fack = 1;
+      else if (r == 1 || (r == 2 && !p->fack))
+        pn532_frame_end(p, PN532_ERR_BADACK);
+      else if (r == 2)
+        pn532_frame_end(p, 0);
+      else if (r < 0)
+        pn532_frame_end(p, -r);
+    }
+  }
+  if (p->fphase == PN532_POLL_BUSY && (uint32_t)(now - p->fstart) >= p->fms)
+    pn532_frame_end(p, p->fack ? PN532_ERR_TIMEOUT : PN532_ERR_TIMEOUTACK);
+  return p->fphase;
+}
+
+int pn532_collect(pn532_t *p, int max1, uint8_t *data1, int max2, uint8_t *data2)
+{ // Get response of completed non-blocking command, returns len or -ve for error
+  if (!p)
+    return -PN532_ERR_NULL;
+  if (p->fphase == PN532_POLL_IDLE)
+    return -(p->lasterr = PN532_ERR_NOTPENDING);
+  if (p->fphase == PN532_POLL_BUSY)
+    return -(p->lasterr = PN532_ERR_CMDPENDING);
+  int l = -p->lasterr;
+  if (p->fphase == PN532_POLL_COMPLETE)
+  {
+    l = p->flen;
+    if (l > max1 + max2)
+      l = -(p->lasterr = PN532_ERR_SPACE); // Too big
+    else
+    {
+      int n = (l < max1 ? l : max1);
+      if (data1 && n)
+        memcpy(data1, p->frame, n);
+      if (data2 && l > n)
+        memcpy(data2, p->frame + n, l - n);
+    }
+  }
+  p->fphase = PN532_POLL_IDLE;
+  xSemaphoreGive(p->mutex);
+  return l;
+}
+
 #define PN532_PACKBUFFSIZ 64
 static uint8_t pn532_packetbuffer[PN532_PACKBUFFSIZ] = {0};
 
@@ -605,7 +1610,50 @@ int pn532_mifareclassic_FormatNDEF(pn532_t *obj)
   return 1;
 }
 
+static uint32_t pn532_air_saved(int bytes, uint8_t br)
+{ // us saved on air for bytes (9 bits each with parity) at br rather than 106 kbps
+  uint64_t ns = bytes * 9ULL * 9440; // 128/13.56MHz per bit at 106 kbps
+  return (ns - (ns >> br)) / 1000;
+}
+
 // Data exchange (for DESFire use)
+static int pn532_dx_status(pn532_t *p, unsigned int len, int l, uint8_t status, uint8_t *data)
+{ // Check InDataExchange status of reply (l inc status byte)
+  if (!l)
+    l = -PN532_ERR_SHORT;
+  else if (l >= 1 && status)
+    l = -PN532_ERR_STATUS - status;
+  else if (l > 0 && (p->brit || p->brti))
+  { // Time saved by raised bit rate (PCB and CRC on top of data)
+    p->psllast = pn532_air_saved(len + 3, p->brit) + pn532_air_saved(l - 1 + 3, p->brti);
+    p->pslsaved += p->psllast;
+    p->pslexchanges++;
+  }
+#ifdef CONFIG_PN532_DEBUG_DX
+#ifndef CONFIG_PN532_DUMP
+  if (l > 0)
+    ESP_LOG_BUFFER_HEX_LEVEL("NFCRx", data, l - 1, DXLOG);
+#endif
+#endif
+  return l;
+}
+
+static int pn532_dx_end(pn532_t *p, int l, const char **strerr)
+{ // Error logging and status byte removal for pn532_dx
+  if (l < 0)
+  {
+    p->lasterr = -l;
+#ifdef CONFIG_PN532_DEBUG_DX
+    ESP_LOG_LEVEL(DXLOG, "NFCErr", "%s", pn532_err_to_name(p->lasterr));
+#endif
+    if (strerr)
+      *strerr = pn532_err_to_name(p->lasterr);
+  }
+  else
+    l--; // Allow for status
+  return l;
+}
+
 int pn532_dx(void *pv, unsigned int len, uint8_t *data, unsigned int max, const char **strerr)
 { // Card access function - sends to card starting CMD byte, and receives reply in to same buffer, starting status byte, returns len
   if (strerr)
@@ -625,31 +1673,38 @@ int pn532_dx(void *pv, unsigned int len, uint8_t *data, unsigned int max, const
   {
     uint8_t status;
     l = pn532_rx(p, 1, &status, max, data, 500);
-    if (!l)
-      l = -PN532_ERR_SHORT;
-    else if (l >= 1 && status)
-      l = -PN532_ERR_STATUS - status;
+    l = pn532_dx_status(p, len, l, status, data);
+  }
+  return pn532_dx_end(p, l, strerr);
+}
+
+int pn532_dx_start(pn532_t *p, uint32_t now, unsigned int len, uint8_t *data)
+{ // Non-blocking pn532_dx, pn532_poll until complete then pn532_dx_collect
+  if (!p)
+    return -PN532_ERR_NULL;
+  if (!p->cards)
+    return -(p->lasterr = PN532_ERR_NOTPENDING); // No card
 #ifdef CONFIG_PN532_DEBUG_DX
 #ifndef CONFIG_PN532_DUMP
-    if (l > 0)
-      ESP_LOG_BUFFER_HEX_LEVEL("NFCRx", data, l - 1, DXLOG);
-#endif
+  ESP_LOG_BUFFER_HEX_LEVEL("NFCTx", data, len, DXLOG);
 #endif
-  }
-  if (l < 0)
-  {
-    p->lasterr = -l;
-#ifdef CONFIG_PN532_DEBUG_DX
-    ESP_LOG_LEVEL(DXLOG, "NFCErr", "%s", pn532_err_to_name(p->lasterr));
 #endif
-    if (strerr)
-      *strerr = pn532_err_to_name(p->lasterr);
-  }
-  else
-    l--; // Allow for status
+  int l = pn532_start(p, now, 500, PN532_COMMAND_INDATAEXCHANGE, 1, &p->tg, len, data);
+  if (l >= 0)
+    p->dxlen = len;
   return l;
 }
 
+int pn532_dx_collect(pn532_t *p, unsigned int max, uint8_t *data)
+{ // Reply of pn532_dx_start, as pn532_dx
+  if (!p)
+    return -PN532_ERR_NULL;
+  uint8_t status = 0;
+  int l = pn532_collect(p, 1, &status, max, data);
+  l = pn532_dx_status(p, p->dxlen, l, status, data);
+  return pn532_dx_end(p, l, NULL);
+}
+
 int pn532_send_get_firmware_version(pn532_t *p)
 {
   if (!p)
@@ -661,18 +1716,280 @@ int pn532_send_get_firmware_version(pn532_t *p)
   return 0; // Waiting
 }
 
+// Card identification
+static const pn532_family_desc_t pn532_families[PN532_FAMILY_MAX] = {
+    [PN532_FAMILY_UNKNOWN] = {PN532_FAMILY_UNKNOWN, "Unknown", 0, 0, 0, PN532_PRESENCE_REPOLL, 0},
+    [PN532_FAMILY_TYPE2] = {PN532_FAMILY_TYPE2, "Type 2", 0, 0, PN532_FAST_READ16, PN532_PRESENCE_READ, 1},
+    [PN532_FAMILY_ULTRALIGHT] = {PN532_FAMILY_ULTRALIGHT, "MIFARE Ultralight", 48, 15, PN532_FAST_READ16, PN532_PRESENCE_READ, 0},
+    [PN532_FAMILY_NTAG203] = {PN532_FAMILY_NTAG203, "NTAG203 or MIFARE Ultralight C", 144, 39, PN532_FAST_READ16, PN532_PRESENCE_READ, 0},
+    [PN532_FAMILY_ULTRALIGHT_EV1_11] = {PN532_FAMILY_ULTRALIGHT_EV1_11, "MIFARE Ultralight EV1 (MF0UL11)", 48, 15, PN532_FAST_READ16 | PN532_FAST_FASTREAD | PN532_FAST_GETVERSION, PN532_PRESENCE_READ, 0},
+    [PN532_FAMILY_ULTRALIGHT_EV1_21] = {PN532_FAMILY_ULTRALIGHT_EV1_21, "MIFARE Ultralight EV1 (MF0UL21)", 128, 35, PN532_FAST_READ16 | PN532_FAST_FASTREAD | PN532_FAST_GETVERSION, PN532_PRESENCE_READ, 0},
+    [PN532_FAMILY_NTAG213] = {PN532_FAMILY_NTAG213, "NTAG213", 144, NTAG_213_MAX_PAGE, PN532_FAST_READ16 | PN532_FAST_FASTREAD | PN532_FAST_GETVERSION, PN532_PRESENCE_READ, 0},
+    [PN532_FAMILY_NTAG215] = {PN532_FAMILY_NTAG215, "NTAG215", 504, NTAG_215_MAX_PAGE, PN532_FAST_READ16 | PN532_FAST_FASTREAD | PN532_FAST_GETVERSION, PN532_PRESENCE_READ, 0},
+    [PN532_FAMILY_NTAG216] = {PN532_FAMILY_NTAG216, "NTAG216", 888, NTAG_216_MAX_PAGE, PN532_FAST_READ16 | PN532_FAST_FASTREAD | PN532_FAST_GETVERSION, PN532_PRESENCE_READ, 0},
+    [PN532_FAMILY_CLASSIC_MINI] = {PN532_FAMILY_CLASSIC_MINI, "MIFARE Classic Mini", 320, 19, PN532_FAST_AUTH, PN532_PRESENCE_REPOLL, 0},
+    [PN532_FAMILY_CLASSIC_1K] = {PN532_FAMILY_CLASSIC_1K, "MIFARE Classic 1K", 1024, 63, PN532_FAST_AUTH, PN532_PRESENCE_REPOLL, 0},
+    [PN532_FAMILY_CLASSIC_4K] = {PN532_FAMILY_CLASSIC_4K, "MIFARE Classic 4K", 4096, 255, PN532_FAST_AUTH, PN532_PRESENCE_REPOLL, 0},
+    [PN532_FAMILY_DESFIRE] = {PN532_FAMILY_DESFIRE, "MIFARE DESFire", 0, 0, PN532_FAST_APDU, PN532_PRESENCE_DIAGNOSE, 0},
+    [PN532_FAMILY_ISO14443_4] = {PN532_FAMILY_ISO14443_4, "ISO/IEC14443-4", 0, 0, PN532_FAST_APDU, PN532_PRESENCE_REPOLL, 0},
+    [PN532_FAMILY_FELICA] = {PN532_FAMILY_FELICA, "FeliCa", 0, 0, 0, PN532_PRESENCE_REPOLL, 0},
+    [PN532_FAMILY_ISO14443B] = {PN532_FAMILY_ISO14443B, "ISO/IEC14443 Type B", 0, 0, PN532_FAST_APDU, PN532_PRESENCE_REPOLL, 0},
+    [PN532_FAMILY_JEWEL] = {PN532_FAMILY_JEWEL, "Jewel/Topaz", 0, 0, 0, PN532_PRESENCE_REPOLL, 0},
+};
+
+static const pn532_family_desc_t *pn532_classify(pn532_t *p)
+{ // Family from SAK/ATQA/ATS alone
+  if (p->sel_res & 0x20)
+  { // ISO/IEC14443-4 compliant
+    if (*p->ats && p->ats[1] == 0x75)
+      return &pn532_families[PN532_FAMILY_DESFIRE];
+    return &pn532_families[PN532_FAMILY_ISO14443_4];
+  }
+  switch (p->sel_res)
+  {
+  case 0x00:
+    if (p->sens_res == 0x0044)
+      return &pn532_families[PN532_FAMILY_TYPE2]; // Needs GET_VERSION (or CC) to tell which
+    break;
+  case 0x09:
+    return &pn532_families[PN532_FAMILY_CLASSIC_MINI];
+  case 0x08:
+  case 0x88:
+    return &pn532_families[PN532_FAMILY_CLASSIC_1K];
+  case 0x18:
+    return &pn532_families[PN532_FAMILY_CLASSIC_4K];
+  }
+  return &pn532_families[PN532_FAMILY_UNKNOWN];
+}
+
+static int pn532_thru(pn532_t *p, unsigned int len, uint8_t *data, unsigned int max)
+{ // Raw exchange with card (InCommunicateThru), reply in to same buffer, returns len
+  int l = pn532_tx(p, 0x42, 0, NULL, len, data);
+  if (l >= 0)
+  {
+    uint8_t status;
+    l = pn532_rx(p, 1, &status, max, data, 500);
+    if (!l)
+      l = -(p->lasterr = PN532_ERR_SHORT);
+    else if (l >= 1 && status)
+      l = -(p->lasterr = PN532_ERR_STATUS + (status & 0x3F));
+    else if (l > 0)
+      l--; // Allow for status
+  }
+  return l;
+}
+
+static const pn532_family_desc_t *pn532_probe(pn532_t *p)
+{ // GET_VERSION for Type 2 cards, else size from the CC
+  uint8_t buf[16] = {0x60};
+  if (pn532_thru(p, 1, buf, 8) < 8)
+  { // Not supported, card now halted so select again and read the CC (page 3)
+    if (pn532_Cards(p) <= 0)
+      return &pn532_families[PN532_FAMILY_TYPE2];
+    buf[0] = MIFARE_CMD_READ;
+    buf[1] = 3;
+    if (pn532_dx(p, 2, buf, sizeof(buf), NULL) >= 4)
+      switch (buf[2])
+      { // Data area size / 8
+      case 0x06:
+        return &pn532_families[PN532_FAMILY_ULTRALIGHT];
+      case 0x12:
+        return &pn532_families[PN532_FAMILY_NTAG203];
+      }
+    return &pn532_families[PN532_FAMILY_TYPE2]; // Size not known, rather than guess it
+  }
+  if (buf[1] == 0x04 && buf[2] == 0x04)
+    switch (buf[6])
+    { // NTAG storage size
+    case 0x0F:
+      return &pn532_families[PN532_FAMILY_NTAG213];
+    case 0x11:
+      return &pn532_families[PN532_FAMILY_NTAG215];
+    case 0x13:
+      return &pn532_families[PN532_FAMILY_NTAG216];
+    }
+  if (buf[1] == 0x04 && buf[2] == 0x03)
+    switch (buf[6])
+    { // Ultralight EV1 storage size
+    case 0x0B:
+      return &pn532_families[PN532_FAMILY_ULTRALIGHT_EV1_11];
+    case 0x0E:
+      return &pn532_families[PN532_FAMILY_ULTRALIGHT_EV1_21];
+    }
+  return &pn532_families[PN532_FAMILY_TYPE2];
+}
+
+static const pn532_family_desc_t *pn532_idcache_find(pn532_t *p)
+{
+  if (!*p->nfcid)
+    return NULL;
+  for (int i = 0; i < PN532_IDCACHE; i++)
+    if (p->idcache[i].family && !memcmp(p->idcache[i].nfcid, p->nfcid, *p->nfcid + 1))
+      return p->idcache[i].family;
+  return NULL;
+}
+
+const pn532_family_desc_t *pn532_family(pn532_t *p)
+{
+  if (!p || !p->cards || !p->family)
+    return &pn532_families[PN532_FAMILY_UNKNOWN];
+  return p->family;
+}
+
+const pn532_family_desc_t *pn532_identify(pn532_t *p)
+{
+  if (!p || !p->cards || !p->family)
+    return &pn532_families[PN532_FAMILY_UNKNOWN];
+  if (!p->family->probe || pn532_idcache_find(p))
+    return p->family; // Nothing more to learn, or probed before
+  uint8_t nfcid[sizeof(p->nfcid)];
+  memcpy(nfcid, p->nfcid, sizeof(nfcid));
+  const pn532_family_desc_t *f = pn532_probe(p);
+  if (memcmp(nfcid, p->nfcid, sizeof(nfcid)))
+    return pn532_family(p); // Different card after re-select
+  p->family = f;
+  if (*p->nfcid)
+  { // Remember so we do not probe this card again
+    int i = p->idnext++ % PN532_IDCACHE;
+    memcpy(p->idcache[i].nfcid, p->nfcid, sizeof(p->nfcid));
+    p->idcache[i].family = f;
+  }
+  return f;
+}
+
+// Bit rate
+static const uint16_t pn532_kbps[] = {106, 212, 424, 848};
+
+static int pn532_br_best(uint8_t mask, int max)
+{ // Highest bit rate up to max in TA(1) DS/DR mask (bit 0 = 212)
+  while (max && !(mask & (1 << (max - 1))))
+    max--;
+  return max;
+}
+
+int pn532_psl(pn532_t *p, uint8_t max)
+{ // Raise bit rate of ISO/IEC14443-4 card from TA(1), falling back to lower rates, returns kbps
+  if (!p)
+    return -PN532_ERR_NULL;
+  p->brit = p->brti = PN532_BR_106;
+  if (!p->cards || !(p->sel_res & 0x20) || *p->ats < 2 || !(p->ats[1] & 0x10))
+    return pn532_kbps[PN532_BR_106]; // Not ISO-DEP, or no TA(1) so 106 kbps only
+  if (max > PN532_BR_848)
+    max = PN532_BR_848;
+  uint8_t ta = p->ats[2],
+          dr = (ta & 0x07),        // PCD to PICC
+          ds = ((ta >> 4) & 0x07); // PICC to PCD
+  if (ta & 0x80)
+    dr = ds = (dr & ds); // Same bit rate both ways
+  int l = 0,
+      lastit = -1,
+      lastti = -1;
+  for (int r = max; r > PN532_BR_106; r--)
+  {
+    int it = pn532_br_best(dr, r),
+        ti = pn532_br_best(ds, r);
+    if ((!it && !ti) || (it == lastit && ti == lastti))
+      continue;
+    lastit = it;
+    lastti = ti;
+    uint8_t buf[3];
+    buf[0] = p->tg;
+    buf[1] = it; // BRit
+    buf[2] = ti; // BRti
+    l = pn532_tx(p, 0x4E, 0, NULL, 3, buf);
+    if (l >= 0)
+      l = pn532_rx(p, 0, NULL, 1, buf, 100);
+    if (l >= 1 && *buf)
+      l = -(p->lasterr = PN532_ERR_STATUS + (*buf & 0x3F));
+    if (l >= 0)
+    {
+      p->brit = it;
+      p->brti = ti;
+      break;
+    }
+  }
+  if (l < 0)
+    ESP_LOGD(TAG, "InPSL failed %s, staying at 106 kbps", pn532_err_to_name(pn532_lasterr(p)));
+  return pn532_kbps[p->brit < p->brti ? p->brit : p->brti];
+}
+
+void pn532_psl_auto(pn532_t *p, uint8_t max)
+{
+  if (p)
+    p->pslauto = (max > PN532_BR_848 ? PN532_BR_848 : max);
+}
+
+int pn532_rate(pn532_t *p, pn532_rate_t *r)
+{
+  if (!p)
+    return -PN532_ERR_NULL;
+  if (!r)
+    return -(p->lasterr = PN532_ERR_SPACE);
+  r->it_kbps = pn532_kbps[p->brit];
+  r->ti_kbps = pn532_kbps[p->brti];
+  r->exchanges = p->pslexchanges;
+  r->last_saved_us = p->psllast;
+  r->saved_us = p->pslsaved;
+  return 0;
+}
+
 // Other higher level functions
+static int pn532_ILPT_again(pn532_t *p)
+{ // InListPassiveTarget for type last set up
+  uint8_t buf[2];
+  buf[0] = (p->brty ? 1 : 2); // 2 tags for type A (we only report 1)
+  buf[1] = p->brty;
+  p->aborted = 0; // New poll
+  int l = pn532_tx(p, 0x4A, 2, buf, p->initlen, p->initdata);
+  if (l < 0)
+    return l;
+  return 0; // Waiting
+}
+
+static void pn532_ILPT_setup(pn532_t *p, uint8_t brty, uint8_t afi, uint16_t syscode)
+{ // InListPassiveTarget BrTy and InitiatorData for pn532_ILPT_again
+  p->brty = brty;
+  p->initlen = 0;
+  if (brty == 1 || brty == 2)
+  { // FeliCa
+    p->initdata[p->initlen++] = 0x00;         // Polling
+    p->initdata[p->initlen++] = syscode >> 8; // System code (0xFFFF for any)
+    p->initdata[p->initlen++] = syscode;
+    p->initdata[p->initlen++] = 0x01; // Request system code
+    p->initdata[p->initlen++] = 0x00; // Time slot
+  }
+  else if (brty == 3)
+    p->initdata[p->initlen++] = afi; // Type B AFI (0 for all)
+}
+
 int pn532_ILPT_Send(pn532_t *p)
 {
   if (!p)
     return -PN532_ERR_NULL;
-  uint8_t buf[3];
   // InListPassiveTarget
-  buf[0] = 2; // 2 tags (we only report 1)
-  buf[1] = 0; // 106 kbps type A (ISO/IEC14443 Type A)
-  int l = pn532_tx(p, 0x4A, 2, buf, 0, NULL);
+  pn532_ILPT_setup(p, 0, 0, 0); // 106 kbps type A (ISO/IEC14443 Type A)
+  return pn532_ILPT_again(p);
+}
+
+int pn532_felica_ILPT_Send(pn532_t *p, uint8_t br, uint16_t syscode)
+{ // InListPassiveTarget for FeliCa at 212 or 424 kbps, with system code polling
+  if (!p)
+    return -PN532_ERR_NULL;
+  pn532_ILPT_setup(p, (br == PN532_BR_424 ? 2 : 1), 0, syscode);
+  return pn532_ILPT_again(p);
+}
+
+int pn532_ILPT_Start(pn532_t *p, uint32_t now)
+{ // Non-blocking InListPassiveTarget, pn532_poll until complete then pn532_Cards
+  if (!p)
+    return -PN532_ERR_NULL;
+  uint8_t buf[2];
+  buf[0] = (p->brty ? 1 : 2); // 2 tags for type A (we only report 1)
+  buf[1] = p->brty;           // Type last set up by pn532_ILPT_Send etc
+  int l = pn532_start(p, now, 110, 0x4A, 2, buf, p->initlen, p->initdata);
   if (l < 0)
     return l;
+  p->aborted = 0; // New poll
   return 0; // Waiting
 }
 
@@ -680,15 +1997,20 @@ int pn532_Present(pn532_t *p)
 {
   if (!p)
     return -PN532_ERR_NULL;
-  uint8_t buf[1];
-  if (!p->pending && p->cards && *p->ats && (p->ats[1] == 0x75 // DESFire
-                                                               //|| p->ats[1] == 0x78      // ISO
-                                             ))
+  uint8_t buf[16];
+  if (!p->pending && p->cards && p->family && p->family->presence == PN532_PRESENCE_READ)
+  { // Type 2, reading a page is quicker than a new poll
+    buf[0] = MIFARE_CMD_READ;
+    buf[1] = 0;
+    if (pn532_dx(p, 2, buf, sizeof(buf), NULL) >= 4)
+      return p->cards; // Still in field
+  }
+  if (!p->pending && p->cards && p->family && p->family->presence == PN532_PRESENCE_DIAGNOSE)
   {             // We have cards, check in field still
     buf[0] = 6; // Test 6 Attention Request Test or ISO/IEC14443-4 card presence detection
     int l = pn532_tx(p, 0x00, 1, buf, 0, NULL);
     if (l >= 0)
-      l = pn532_rx(p, 0, NULL, sizeof(buf), buf, 110);
+      l = pn532_rx(p, 0, NULL, 1, buf, 110);
     if (l < 0)
       return l;
     if (l < 1)
@@ -727,23 +2049,20 @@ int pn532_write_GPIO(pn532_t *p, uint8_t value)
 { // Write P3/P7 (P72/P71 in top bits, P35-30 in rest)
   if (!p)
     return -PN532_ERR_NULL;
-  uint8_t buf[2];
-  buf[0] = 0x80 | (value & 0x3F);
-  buf[1] = 0x80 | ((value >> 5) & 0x06);
-  int l = pn532_tx(p, 0x0E, 2, buf, 0, NULL);
+  int l = pn532_reg_add(p, PN532_REG_P3, 0xC0 | (value & 0x3F));
+  if (l >= 0)
+    l = pn532_reg_add(p, PN532_REG_P7, 0xF9 | ((value >> 5) & 0x06));
   if (l >= 0)
-    l = pn532_rx(p, 0, NULL, sizeof(buf), buf, 50);
+    l = pn532_reg_due(p);
   return l;
 }
 
-int pn532_read_GPIO(pn532_t *p)
+int pn532_read_GPIO_inputs(pn532_t *p)
 { // Read P3/P7 (P72/P71 in top bits, P35-30 in rest)
   if (!p)
     return -PN532_ERR_NULL;
   uint8_t buf[3];
-  int l = pn532_tx(p, 0x0C, 0, NULL, 0, NULL);
-  if (l >= 0)
-    l = pn532_rx(p, 0, NULL, sizeof(buf), buf, 50);
+  int l = pn532_cmd(p, 0x0C, 0, NULL, sizeof(buf), buf, 50);
   if (l < 0)
     return l;
   if (l < 3)
@@ -751,11 +2070,25 @@ int pn532_read_GPIO(pn532_t *p)
   return (buf[0] & 0x3F) | ((buf[1] & 0x06) << 5);
 }
 
+int pn532_read_GPIO(pn532_t *p)
+{ // Read P3/P7 (P72/P71 in top bits, P35-30 in rest)
+  if (!p)
+    return -PN532_ERR_NULL;
+  if (p->outputs == 0xFF)
+  { // All host outputs, no need to ask
+    uint8_t p3,
+        p7;
+    if (pn532_shadow_get(p, PN532_REG_P3, &p3) && pn532_shadow_get(p, PN532_REG_P7, &p7))
+      return (p3 & 0x3F) | ((p7 & 0x06) << 5);
+  }
+  return pn532_read_GPIO_inputs(p);
+}
+
 uint32_t pn532_get_firmware_version(pn532_t *p)
 {
   if (!p)
     return -PN532_ERR_NULL;
-  uint8_t buf[100];
+  uint8_t buf[4];
 
   if (!p->pending)
     pn532_send_get_firmware_version(p);
@@ -780,24 +2113,86 @@ int pn532_Cards(pn532_t *p)
 { // -ve for error, else number of cards
   if (!p)
     return -PN532_ERR_NULL;
-  uint8_t buf[100];
-  // InListPassiveTarget to get card count and baseID
-  if (!p->pending)
-    pn532_ILPT_Send(p);
-  if (p->pending != 0x4B)
-    return -(p->lasterr = PN532_ERR_CMDMISMATCH); // We expect to be waiting for InListPassiveTarget response
-  int l = pn532_rx(p, 0, NULL, sizeof(buf), buf, 110);
+  uint8_t *buf = p->rxbuf;
+  int l,
+      collected = 0;
+  if (p->fphase && p->fcmd == 0x4B)
+  { // Non-blocking InListPassiveTarget (pn532_start), use response if complete
+    if (p->fphase == PN532_POLL_BUSY)
+      return -(p->lasterr = PN532_ERR_CMDPENDING);
+    l = pn532_collect(p, 0, NULL, sizeof(p->rxbuf), buf);
+    collected = 1;
+  }
+  else
+  { // InListPassiveTarget to get card count and baseID
+    portENTER_CRITICAL(&p->lock);
+    int aborted = (p->aborted && !p->pending);
+    p->aborted = 0;
+    portEXIT_CRITICAL(&p->lock);
+    if (aborted)
+      return -(p->lasterr = PN532_ERR_ABORTED); // Poll was taken over by a high priority command, repeat it
+    if (!p->pending)
+      pn532_ILPT_again(p);
+    if (p->pending != 0x4B)
+      return -(p->lasterr = PN532_ERR_CMDMISMATCH); // We expect to be waiting for InListPassiveTarget response
+    l = pn532_rx(p, 0, NULL, sizeof(p->rxbuf), buf, 110);
+  }
   if (l < 0)
     return l;
   memset(p->nfcid, 0, sizeof(p->nfcid));
   memset(p->ats, 0, sizeof(p->ats));
+  p->family = NULL;
+  p->brit = p->brti = PN532_BR_106;
   // Extract first card ID
   uint8_t *b = buf,
           *e = buf + l; // end
   if (b >= e)
     return -(p->lasterr = PN532_ERR_SHORT); // No card count
   p->cards = *b++;
-  if (p->cards)
+  if (p->cards && (p->brty == 1 || p->brty == 2))
+  { // FeliCa
+    if (b + 2 > e)
+      return -(p->lasterr = PN532_ERR_SPACE); // No card data
+    p->tg = *b++;
+    if (*b < 18 || b + *b > e)
+      return -(p->lasterr = PN532_ERR_SHORT); // Too short for POL_RES
+    memcpy(p->idm, b + 2, sizeof(p->idm));
+    memcpy(p->pmm, b + 10, sizeof(p->pmm));
+    p->syscode = (*b >= 20 ? (b[18] << 8) + b[19] : 0);
+    p->nfcid[0] = sizeof(p->idm);
+    memcpy(p->nfcid + 1, p->idm, sizeof(p->idm));
+    p->sens_res = 0;
+    p->sel_res = 0;
+    if (memcmp(p->idm, p->fidm, sizeof(p->idm)))
+      p->felicamax = 0; // New card, find its limit again
+    memcpy(p->fidm, p->idm, sizeof(p->idm));
+    p->family = &pn532_families[PN532_FAMILY_FELICA];
+  }
+  else if (p->cards && p->brty == 3)
+  { // Type B, ATQB and ATTRIB_RES
+    if (b + 14 > e)
+      return -(p->lasterr = PN532_ERR_SPACE); // No card data
+    p->tg = *b++;
+    if (*b != 0x50 || b + 13 + b[12] > e)
+      return -(p->lasterr = PN532_ERR_SHORT); // Not ATQB or no ATTRIB_RES
+    p->nfcid[0] = 4;
+    memcpy(p->nfcid + 1, b + 1, 4); // PUPI
+    p->sens_res = 0;
+    p->sel_res = 0;
+    p->family = &pn532_families[PN532_FAMILY_ISO14443B];
+  }
+  else if (p->cards && p->brty == 4)
+  { // Jewel, SENS_RES and JEWELID
+    if (b + 7 > e)
+      return -(p->lasterr = PN532_ERR_SHORT);
+    p->tg = *b++;
+    p->sens_res = (b[0] << 8) + b[1];
+    p->sel_res = 0;
+    p->nfcid[0] = 4;
+    memcpy(p->nfcid + 1, b + 2, 4);
+    p->family = &pn532_families[PN532_FAMILY_JEWEL];
+  }
+  else if (p->cards)
   { // Get details of first card
     if (b + 5 > e)
       return -(p->lasterr = PN532_ERR_SPACE); // No card data
@@ -823,10 +2218,946 @@ int pn532_Cards(pn532_t *p)
       }
       b += *b; // ready for second target (which we are not looking at)
     }
+    p->family = pn532_idcache_find(p);
+    if (!p->family)
+      p->family = pn532_classify(p);
+    if (p->pslauto && (p->sel_res & 0x20) && !collected)
+      pn532_psl(p, p->pslauto); // Must be straight after activation (blocks, so not when collecting a non-blocking poll)
   }
+  else
+    p->family = NULL;
   return p->cards;
 }
 
+// FeliCa
+int pn532_felica_id(pn532_t *p, uint8_t idm[8], uint8_t pmm[8], uint16_t *syscode)
+{
+  if (!p)
+    return -PN532_ERR_NULL;
+  if (!p->cards || !p->family || p->family->family != PN532_FAMILY_FELICA)
+    return -(p->lasterr = PN532_ERR_NOTPENDING); // No FeliCa card
+  if (idm)
+    memcpy(idm, p->idm, sizeof(p->idm));
+  if (pmm)
+    memcpy(pmm, p->pmm, sizeof(p->pmm));
+  if (syscode)
+    *syscode = p->syscode;
+  return 0;
+}
+
+int pn532_felica_read(pn532_t *p, uint16_t service, uint16_t block, int count, uint8_t *data)
+{ // Read Without Encryption, as many blocks per command as card and frame allow, returns blocks read
+  if (!p)
+    return -PN532_ERR_NULL;
+  if (!p->cards || !p->family || p->family->family != PN532_FAMILY_FELICA)
+    return -(p->lasterr = PN532_ERR_NOTPENDING); // No FeliCa card
+  p->felicasf = 0;
+  int done = 0;
+  while (done < count)
+  {
+    int n = count - done;
+    if (n > PN532_FELICA_BLOCKS)
+      n = PN532_FELICA_BLOCKS; // Response must fit in a normal frame
+    if (p->felicamax && n > p->felicamax)
+      n = p->felicamax;
+    uint8_t cmd[14 + PN532_FELICA_BLOCKS * 3],
+        res[1 + 13];
+    int c = 1;
+    cmd[c++] = 0x06; // Read Without Encryption
+    memcpy(cmd + c, p->idm, sizeof(p->idm));
+    c += sizeof(p->idm);
+    cmd[c++] = 1; // One service
+    cmd[c++] = service;
+    cmd[c++] = service >> 8;
+    cmd[c++] = n;
+    for (int i = 0; i < n; i++)
+    {
+      uint16_t b = block + done + i;
+      if (b < 0x100)
+      { // 2 byte block list element
+        cmd[c++] = 0x80;
+        cmd[c++] = b;
+      }
+      else
+      { // 3 byte block list element
+        cmd[c++] = 0x00;
+        cmd[c++] = b;
+        cmd[c++] = b >> 8;
+      }
+    }
+    cmd[0] = c; // Len
+    int l = pn532_tx(p, PN532_COMMAND_INDATAEXCHANGE, 1, &p->tg, c, cmd);
+    if (l >= 0)
+      l = pn532_rx(p, sizeof(res), res, n * 16, data + done * 16, 500);
+    if (l >= 1 && *res)
+      l = -(p->lasterr = PN532_ERR_STATUS + (*res & 0x3F));
+    if (l < 0)
+      return l;
+    if (l < 1 + 12 || res[2] != 0x07)
+      return -(p->lasterr = PN532_ERR_SHORT);
+    if (res[11])
+    { // Status flag 1 set - card refused
+      ESP_LOGD(TAG, "FeliCa read %d blocks status %02X %02X", n, res[11], res[12]);
+      if (res[12] == 0xA2 && n > 1)
+      { // Too many blocks, try fewer
+        p->felicamax = n / 2;
+        continue;
+      }
+      p->felicasf = (res[11] << 8) + res[12]; // Bad block, service, etc, for pn532_felica_status
+      return -(p->lasterr = PN532_ERR_STATUS_PROTOCOL);
+    }
+    if (l < (int)sizeof(res) + n * 16 || res[13] != n)
+      return -(p->lasterr = PN532_ERR_SHORT);
+    done += n;
+  }
+  return done;
+}
+
+int pn532_felica_status(pn532_t *p)
+{
+  if (!p)
+    return -PN532_ERR_NULL;
+  return p->felicasf;
+}
+
+// RF profiles
+static const struct
+{
+  const char *name;
+  uint8_t atr;     // MxRtyATR
+  uint8_t psl;     // MxRtyPSL
+  uint8_t passive; // MxRtyPassiveActivation
+  uint8_t com;     // MaxRtyCOM
+  uint8_t atrto;   // ATR_RES timeout (100*2^(n-1))us
+  uint8_t comto;   // Non DEP timeout (100*2^(n-1))us
+} pn532_rf_profiles[PN532_RF_MAX] = {
+    [PN532_RF_DEFAULT] = {"default", 0xFF, 0x01, 0x01, 1, 0x0B, 0x0A},           // 102.4ms/51.2ms
+    [PN532_RF_FAST_DETECT] = {"fast-detect", 0x02, 0x01, 0x00, 0, 0x08, 0x08},    // 12.8ms/12.8ms
+    [PN532_RF_ROBUST] = {"robust-long-range", 0xFF, 0x03, 0x05, 3, 0x0C, 0x0B},   // 204.8ms/102.4ms
+    [PN532_RF_LOW_POWER] = {"low-power", 0x01, 0x01, 0x00, 0, 0x09, 0x09},        // 25.6ms/25.6ms
+};
+
+const char *pn532_rf_profile_name(pn532_rf_profile_t profile)
+{
+  if (profile >= PN532_RF_MAX)
+    return "unknown";
+  return pn532_rf_profiles[profile].name;
+}
+
+pn532_rf_profile_t pn532_rf_profile_get(pn532_t *p)
+{
+  if (!p || p->rfprofile >= PN532_RF_MAX)
+    return PN532_RF_MAX;
+  return p->rfprofile;
+}
+
+static int pn532_rf_send(pn532_t *p, uint8_t held, pn532_rf_profile_t profile)
+{ // RFConfiguration for profile, held if the caller has the mutex already
+  uint8_t buf[4],
+      res[1];
+  int n,
+      l;
+  // RFConfiguration
+  n = 0;
+  buf[n++] = 5;                                  // Config item 5 (MaxRetries)
+  buf[n++] = pn532_rf_profiles[profile].atr;     // MxRtyATR (default = 0xFF)
+  buf[n++] = pn532_rf_profiles[profile].psl;     // MxRtyPSL (default = 0x01)
+  buf[n++] = pn532_rf_profiles[profile].passive; // MxRtyPassiveActivation
+  l = pn532_cmd_held(p, held, 0x32, n, buf, sizeof(res), res, 50);
+  // RFConfiguration
+  n = 0;
+  buf[n++] = 0x04;                           // MaxRtyCOM
+  buf[n++] = pn532_rf_profiles[profile].com; // Retries (default 0)
+  if (l >= 0)
+    l = pn532_cmd_held(p, held, 0x32, n, buf, sizeof(res), res, 50);
+  // RFConfiguration
+  n = 0;
+  buf[n++] = 0x02;                             // Various timings (100*2^(n-1))us
+  buf[n++] = 0x00;                             // RFU
+  buf[n++] = pn532_rf_profiles[profile].atrto; // Default 0x0B (102.4 ms)
+  buf[n++] = pn532_rf_profiles[profile].comto; // Default is 0x0A (51.2 ms)
+  if (l >= 0)
+    l = pn532_cmd_held(p, held, 0x32, n, buf, sizeof(res), res, 50);
+  if (l < 0)
+  {
+    p->rfprofile = PN532_RF_MAX; // Unknown state
+    return l;
+  }
+  p->rfprofile = profile;
+  return 0;
+}
+
+int pn532_rf_profile(pn532_t *p, pn532_rf_profile_t profile)
+{ // Apply RF retries and timings
+  if (!p)
+    return -PN532_ERR_NULL;
+  if (profile >= PN532_RF_MAX)
+    return -(p->lasterr = PN532_ERR_SPACE);
+  if (profile == p->rfprofile)
+    return 0; // Already set
+  return pn532_rf_send(p, 0, profile);
+}
+
+int pn532_rf_measure(pn532_t *p, pn532_rf_profile_t profile, int polls, pn532_rf_measure_t *m)
+{ // Poll with a profile and record how it does, cards should be tapped while this runs
+  if (!p)
+    return -PN532_ERR_NULL;
+  if (!m)
+    return -(p->lasterr = PN532_ERR_SPACE);
+  memset(m, 0, sizeof(*m));
+  m->profile = profile;
+  pn532_rf_profile_t was = pn532_rf_profile_get(p);
+  int l = pn532_rf_profile(p, profile);
+  if (l < 0)
+    return l;
+  int64_t since = 0; // First empty poll since the last card went (0 while a card is there)
+  uint32_t empty = 0;
+  while (polls--)
+  {
+    int64_t start = esp_timer_get_time();
+    m->polls++;
+    l = pn532_Cards(p);
+    if (l < 0)
+    {
+      m->errors++;
+      continue;
+    }
+    if (!l)
+    { // No card, time the next detection from the first of these
+      if (!since)
+        since = start;
+      empty++;
+      continue;
+    }
+    if (!since)
+      continue; // Same card still there (or there from the start), not a detection
+    uint32_t us = esp_timer_get_time() - since;
+    m->detects++;
+    m->empty += empty;
+    m->detect_us_total += us;
+    if (us > m->detect_us_max)
+      m->detect_us_max = us;
+    since = 0;
+    empty = 0;
+    // Exchange with the card (InDataExchange) to see it is talking at this profile
+    uint8_t buf[20];
+    int len = 0;
+    if (p->family && (p->family->fast & PN532_FAST_READ16))
+    { // READ page 0
+      buf[len++] = MIFARE_CMD_READ;
+      buf[len++] = 0;
+    }
+    else if (p->family && (p->family->fast & PN532_FAST_APDU))
+    { // SELECT MF, any status word will do
+      static const uint8_t sel[] = {0x00, 0xA4, 0x00, 0x0C, 0x02, 0x3F, 0x00};
+      memcpy(buf, sel, sizeof(sel));
+      len = sizeof(sel);
+    }
+    if (!len)
+      continue; // Nothing harmless to send to this card
+    m->exchanges++;
+    if (pn532_dx(p, len, buf, sizeof(buf), NULL) < 2)
+      m->failures++;
+  }
+  if (was < PN532_RF_MAX)
+    pn532_rf_profile(p, was);
+  return m->detects;
+}
+
+// Multi-protocol polling
+#define PN532_MULTI_HIT 8192  // Weight added for a detection (1/8 of all)
+#define PN532_MULTI_COLD 1024 // Below this weight a protocol is cold
+#define PN532_MULTI_PROBE 4   // Default cycles between polls of a cold protocol
+
+static const struct
+{
+  const char *name;
+  uint8_t brty; // InListPassiveTarget BrTy
+} pn532_protos[PN532_PROTO_MAX] = {
+    [PN532_PROTO_A] = {"Type A", 0},
+    [PN532_PROTO_B] = {"Type B", 3},
+    [PN532_PROTO_FELICA212] = {"FeliCa 212", 1},
+    [PN532_PROTO_FELICA424] = {"FeliCa 424", 2},
+    [PN532_PROTO_JEWEL] = {"Jewel", 4},
+};
+
+const char *pn532_proto_name(pn532_proto_t proto)
+{
+  if (proto >= PN532_PROTO_MAX)
+    return "unknown";
+  return pn532_protos[proto].name;
+}
+
+int pn532_multi_config(pn532_multi_t *m, uint8_t protos, uint8_t afi, uint16_t syscode, int adaptive)
+{
+  if (!m)
+    return -PN532_ERR_NULL;
+  memset(m, 0, sizeof(*m));
+  m->protos = protos & PN532_PROTO_ALL;
+  m->adaptive = adaptive;
+  m->afi = afi;
+  m->syscode = syscode;
+  m->probe = PN532_MULTI_PROBE;
+  for (int t = 0; t < PN532_PROTO_MAX; t++)
+    if (m->protos & (1 << t))
+      m->order[m->count++] = t;
+  return m->count;
+}
+
+static uint64_t pn532_multi_cost(pn532_proto_stats_t *s)
+{ // Mean time of an attempt that found nothing, what a protocol costs those after it
+  uint32_t misses = s->polls - s->hits - s->errors;
+  return misses ? s->miss_us / misses : 1;
+}
+
+static void pn532_multi_order(pn532_multi_t *m)
+{ // Highest share of detections per unit cost first (which minimises mean time
+  // to find the card within a cycle), stable so ties keep their order
+  for (int i = 1; i < m->count; i++)
+  {
+    uint8_t t = m->order[i];
+    pn532_proto_stats_t *s = &m->stats[t];
+    uint64_t c = pn532_multi_cost(s);
+    int j = i;
+    while (j)
+    {
+      pn532_proto_stats_t *o = &m->stats[m->order[j - 1]];
+      if ((uint64_t)s->weight * pn532_multi_cost(o) <= (uint64_t)o->weight * c)
+        break;
+      m->order[j] = m->order[j - 1];
+      j--;
+    }
+    m->order[j] = t;
+  }
+}
+
+int pn532_multi_poll(pn532_t *p, pn532_multi_t *m)
+{ // One poll cycle, the first protocol to find a card ends it
+  if (!p)
+    return -PN532_ERR_NULL;
+  if (!m || !m->count)
+    return -(p->lasterr = PN532_ERR_SPACE);
+  if (p->fphase)
+    return -(p->lasterr = PN532_ERR_CMDPENDING); // Non-blocking command in progress
+  if (p->pending == 0x4B)
+    pn532_rx(p, 0, NULL, sizeof(p->rxbuf), p->rxbuf, 110); // From pn532_ILPT_Send, for the type set up then, drop it
+  if (p->pending)
+    return -(p->lasterr = PN532_ERR_CMDPENDING);
+  p->aborted = 0; // A poll taken over earlier was for the type set up then, drop that too
+  int warm = 0; // Skip cold protocols only once something has turned up
+  if (m->adaptive)
+    for (int i = 0; i < m->count; i++)
+      if (m->stats[m->order[i]].weight >= PN532_MULTI_COLD)
+        warm = 1;
+  int64_t start = esp_timer_get_time();
+  m->cycles++;
+  int l = 0,
+      err = 0,
+      hit = 0;
+  for (int i = 0; i < m->count && l <= 0; i++)
+  {
+    uint8_t t = m->order[i];
+    pn532_proto_stats_t *s = &m->stats[t];
+    if (warm && s->weight < PN532_MULTI_COLD && m->probe && m->cycles % m->probe)
+    {
+      s->skips++;
+      continue;
+    }
+    pn532_ILPT_setup(p, pn532_protos[t].brty, m->afi, m->syscode);
+    int64_t t0 = esp_timer_get_time();
+    l = pn532_Cards(p);
+    uint32_t us = esp_timer_get_time() - t0;
+    s->polls++;
+    s->total_us += us;
+    if (l < 0)
+    { // Note it and carry on, so one failing protocol does not starve the rest
+      s->errors++;
+      err = l;
+      continue;
+    }
+    if (!l)
+      s->miss_us += us;
+    else
+    {
+      s->hits++;
+      hit = t;
+    }
+  }
+  int64_t now = esp_timer_get_time();
+  m->cycle_us += now - start;
+  if (l <= 0)
+    return err ? err : 0; // Error only if nothing found
+  m->detects++;
+  m->hit_us += now - start;
+  if (m->adaptive)
+  { // Decay every protocol's share and credit the one that found the card
+    for (int i = 0; i < m->count; i++)
+    {
+      pn532_proto_stats_t *s = &m->stats[m->order[i]];
+      s->weight -= s->weight >> 3;
+    }
+    m->stats[hit].weight += PN532_MULTI_HIT;
+    pn532_multi_order(m);
+  }
+  return l;
+}
+
+int pn532_multi_stats(pn532_multi_t *m, pn532_proto_stats_t *s, uint8_t *order)
+{
+  if (!m)
+    return -PN532_ERR_NULL;
+  if (s)
+    memcpy(s, m->stats, sizeof(m->stats));
+  if (order)
+    memcpy(order, m->order, m->count);
+  return m->count;
+}
+
+// Low power detection
+int pn532_lp_config(pn532_t *p, uint8_t wake, uint8_t restore)
+{
+  if (!p)
+    return -PN532_ERR_NULL;
+  p->lpwake = wake;
+  p->lprestore = restore;
+  return 0;
+}
+
+int pn532_power_down(pn532_t *p)
+{ // PowerDown, HSU always a wake source so the driver can wake it
+  if (!p)
+    return -PN532_ERR_NULL;
+  if (p->lpdown)
+    return 0;
+  uint8_t buf[2],
+      res[1];
+  int n = 0;
+  buf[n++] = p->lpwake | PN532_WAKE_HSU;                      // WakeUpEnable
+  buf[n++] = ((p->lpwake & ~PN532_WAKE_HSU) ? 0x01 : 0x00); // GenerateIRQ (P70_IRQ) if woken by something else
+  int l = pn532_tx(p, 0x16, 0, NULL, n, buf);
+  if (l >= 0)
+    l = pn532_rx(p, 0, NULL, sizeof(res), res, 50);
+  if (l < 0)
+    return l;
+  if (l < 1)
+    return -(p->lasterr = PN532_ERR_SHORT);
+  if (*res)
+    return -(p->lasterr = PN532_ERR_STATUS + (*res & 0x3F));
+  p->cards = 0;
+  p->lpstats.powerdowns++;
+  pn532_lp_state(p, 1);
+  return 0;
+}
+
+int pn532_resume(pn532_t *p)
+{ // Wake by HSU and send again only what was set as lost
+  if (!p)
+    return -PN532_ERR_NULL;
+  if (!p->lpdown)
+    return 0;
+  xSemaphoreTake(p->mutex, portMAX_DELAY);
+  int woke = p->lpdown;
+  if (woke)
+  { // May already be awake (RF/INT), harmless then
+    static const uint8_t wake[] = {0x55, 0x55, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+    uart_flush_input(p->uart);
+    uart_tx(p, wake, sizeof(wake));
+    uart_wait_tx_done(p->uart, 100 / portTICK_PERIOD_MS);
+    usleep(PN532_WAKE_US);
+    pn532_lp_state(p, 0);
+    p->lpwoke = esp_timer_get_time();
+    p->lpstats.wakes++;
+  }
+  int l = 0;
+  if (woke && p->lprestore)
+    l = pn532_restore(p, p->lprestore);
+  xSemaphoreGive(p->mutex);
+  return l;
+}
+
+int pn532_lp_detect(pn532_t *p)
+{ // One low power detection cycle, call when the host wakes (timer or P70_IRQ)
+  if (!p)
+    return -PN532_ERR_NULL;
+  if (p->lpdown)
+  {
+    int l = pn532_resume(p);
+    if (l < 0)
+      return l;
+    p->lpwoken = 1;
+  }
+  if (p->pending)
+    return -(p->lasterr = PN532_ERR_CMDPENDING);
+  int cards = pn532_Cards(p); // Straight away, nothing else needed first
+  if (cards < 0)
+    return cards;
+  if (cards)
+  {
+    if (p->lpwoken)
+    { // Wake to UID
+      uint32_t us = esp_timer_get_time() - p->lpwoke;
+      p->lpstats.detections++;
+      p->lpstats.last_uid_us = us;
+      p->lpstats.total_uid_us += us;
+      if (us > p->lpstats.max_uid_us)
+        p->lpstats.max_uid_us = us;
+      p->lpwoken = 0;
+    }
+    return cards;
+  }
+  p->lpwoken = 0;
+  int l = pn532_power_down(p);
+  if (l < 0)
+    return l;
+  return 0;
+}
+
+int pn532_lp_stats(pn532_t *p, pn532_lp_stats_t *s)
+{
+  if (!p)
+    return -PN532_ERR_NULL;
+  if (!s)
+    return -(p->lasterr = PN532_ERR_SPACE);
+  pn532_lp_state(p, p->lpdown); // Bring time in current state up to date
+  *s = p->lpstats;
+  return 0;
+}
+
+// Target mode
+#define PN532_TG_HDR 10     // Room for extended frame header before TgSetData data
+#define PN532_TG_WAIT 1000  // ms for the reader's next APDU
+
+static const uint8_t pn532_tgget[] = {0x00, 0x00, 0xFF, 0x02, 0xFE, 0xD4, 0x86, 0xA6, 0x00}; // TgGetData
+
+int pn532_target_init(pn532_target_t *t, const uint8_t nfcid[3], const uint8_t *hist, int histlen, pn532_apdu_handler_t *handler, void *arg)
+{ // Build TgInitAsTarget parameters and the fixed part of the TgSetData frame
+  if (!t || !handler)
+    return -PN532_ERR_NULL;
+  if (histlen < 0 || histlen > 15)
+    return -PN532_ERR_SPACE;
+  memset(t, 0, sizeof(*t));
+  t->handler = handler;
+  t->arg = arg;
+  uint8_t *b = t->init;
+  *b++ = 0x05; // Mode, PICC only and passive only
+  *b++ = 0x04; // SENS_RES
+  *b++ = 0x00;
+  if (nfcid)
+    memcpy(b, nfcid, 3); // NFCID1t (PN532 puts 0x08 in front)
+  b += 3;
+  *b++ = 0x20;    // SEL_RES, ISO/IEC14443-4
+  b += 18;        // FeliCaParams, not used
+  b += 10;        // NFCID3t, not used
+  *b++ = 0;       // No general bytes
+  *b++ = histlen; // Historical bytes for the ATS
+  if (histlen)
+    memcpy(b, hist, histlen);
+  b += histlen;
+  t->initlen = b - t->init;
+  t->set[PN532_TG_HDR - 2] = 0xD4;
+  t->set[PN532_TG_HDR - 1] = 0x8E; // TgSetData
+  return 0;
+}
+
+static int pn532_tg_set(pn532_t *p, pn532_target_t *t, int len, int64_t in)
+{ // Send TgSetData with the response the handler left in the frame, and get its status
+  uint8_t *f = t->set + PN532_TG_HDR,
+          sum = (uint8_t)(0xD4 + 0x8E);
+  for (int i = 0; i < len; i++)
+    sum += f[i];
+  f[len] = -sum; // Checksum
+  f[len + 1] = 0x00;
+  int n = len + 2;
+  if (n < 0x100)
+  { // Normal frame
+    f -= 7;
+    f[3] = n;
+    f[4] = -n;
+  }
+  else
+  { // Extended frame
+    f -= 10;
+    f[3] = 0xFF;
+    f[4] = 0xFF;
+    f[5] = n >> 8;
+    f[6] = n;
+    f[7] = -(n >> 8) - (n & 0xFF);
+  }
+  f[0] = 0x00; // No wake up bytes, the PN532 is awake throughout
+  f[1] = 0x00;
+  f[2] = 0xFF;
+  pn532_tx_raw(p, f, t->set + PN532_TG_HDR + len + 2 - f);
+  uint32_t us = esp_timer_get_time() - in;
+  pn532_target_stats_t *s = &t->stats;
+  s->last_turn_us = us;
+  s->total_turn_us += us;
+  if (us > s->max_turn_us)
+    s->max_turn_us = us;
+  int l = pn532_tx_ack(p, 0x8E, len);
+  uint8_t status = 0;
+  if (l >= 0)
+    l = pn532_rx_mutex(p, 0, NULL, 1, &status, 100);
+  else
+    pn532_failed(p, l);
+  if (l == 0)
+    l = -(p->lasterr = PN532_ERR_SHORT);
+  if (l > 0 && status)
+    l = -(p->lasterr = PN532_ERR_STATUS + (status & 0x3F));
+  return l;
+}
+
+static int pn532_tg_gone(int e)
+{ // Status at end of a session that just means the reader went
+  return e == PN532_ERR_STATUS_RELEASED || e == PN532_ERR_STATUS_NOFIELD || e == PN532_ERR_STATUS_DISAPPEARED;
+}
+
+int pn532_target(pn532_t *p, pn532_target_t *t, int ms)
+{ // TgInitAsTarget, then TgGetData, handler, TgSetData until the reader goes
+  if (!p)
+    return -PN532_ERR_NULL;
+  if (!t || !t->handler)
+    return -(p->lasterr = PN532_ERR_NULL);
+  if (p->lpdown)
+  { // Wake first, giving up if that fails
+    int l = pn532_resume(p);
+    if (l < 0)
+      return l;
+  }
+  int l = pn532_lock(p, PN532_PRIO_LOW);
+  if (l < 0)
+    return l;
+  p->cards = 0; // Not an initiator now
+  p->family = NULL;
+  uint8_t res[64];
+  l = pn532_tx_mutex(p, 0x8C, 0, NULL, t->initlen, t->init);
+  if (l >= 0)
+  { // Wait for a reader, a high priority command can abort this
+    portENTER_CRITICAL(&p->lock);
+    p->rxbusy = 0x8D;
+    portEXIT_CRITICAL(&p->lock);
+    l = pn532_rx_frame(p, 0, NULL, sizeof(res), res, ms);
+    p->rxbusy = 0;
+    if (l == -PN532_ERR_TIMEOUT)
+      uart_abort(p); // No reader, stop the PN532 waiting
+    if (l == -PN532_ERR_TIMEOUT || l == -PN532_ERR_ABORTED)
+    {
+      xSemaphoreGive(p->mutex);
+      return 0;
+    }
+    pn532_failed(p, l);
+  }
+  if (l < 0)
+  {
+    t->stats.errors++;
+    xSemaphoreGive(p->mutex);
+    return l;
+  }
+  t->stats.sessions++;
+  int n = 0;
+  while (1)
+  {
+    uint8_t status = 0;
+    pn532_tx_raw(p, pn532_tgget, sizeof(pn532_tgget));
+    l = pn532_tx_ack(p, 0x86, 0);
+    if (l >= 0)
+    { // Wait for the reader's next APDU, a high priority command can abort this
+      portENTER_CRITICAL(&p->lock);
+      p->rxbusy = 0x87;
+      portEXIT_CRITICAL(&p->lock);
+      l = pn532_rx_mutex(p, 1, &status, sizeof(t->apdu), t->apdu, PN532_TG_WAIT);
+      p->rxbusy = 0;
+      if (l == -PN532_ERR_ABORTED)
+      { // Let it in, then wait for the APDU again
+        xSemaphoreGive(p->mutex);
+        if ((l = pn532_lock(p, PN532_PRIO_LOW)) < 0)
+        { // Non-blocking command got in, mutex not ours
+          t->stats.errors++;
+          return l;
+        }
+        continue;
+      }
+    }
+    else
+      pn532_failed(p, l);
+    if (l == 0)
+      l = -(p->lasterr = PN532_ERR_SHORT);
+    if (l > 0 && status)
+      l = -(p->lasterr = PN532_ERR_STATUS + (status & 0x3F));
+    if (l < 0)
+      break;
+    int64_t in = esp_timer_get_time();
+    int r = t->handler(t->arg, t->apdu, l - 1, t->set + PN532_TG_HDR, PN532_TARGET_MAX);
+    uint32_t us = esp_timer_get_time() - in;
+    pn532_target_stats_t *s = &t->stats;
+    s->last_handler_us = us;
+    s->total_handler_us += us;
+    if (us > s->max_handler_us)
+      s->max_handler_us = us;
+    if (r < 0 || r > PN532_TARGET_MAX)
+    { // Handler ended the session
+      l = 0;
+      break;
+    }
+    l = pn532_tg_set(p, t, r, in);
+    s->apdus++;
+    n++;
+    if (l < 0)
+      break;
+    if (p->hiwait)
+    { // Let high priority commands in between APDUs
+      xSemaphoreGive(p->mutex);
+      if ((l = pn532_lock(p, PN532_PRIO_LOW)) < 0)
+      { // Non-blocking command got in, mutex not ours
+        t->stats.errors++;
+        return l;
+      }
+    }
+  }
+  xSemaphoreGive(p->mutex);
+  if (l < 0 && pn532_tg_gone(-l))
+  {
+    t->stats.releases++;
+    l = 0;
+  }
+  if (l < 0)
+  {
+    t->stats.errors++;
+    return l;
+  }
+  return n;
+}
+
+int pn532_target_stats(pn532_target_t *t, pn532_target_stats_t *s)
+{
+  if (!t || !s)
+    return -PN532_ERR_NULL;
+  *s = t->stats;
+  return 0;
+}
+
+// Card scripts
+static int pn532_script_step(pn532_script_t *s, uint8_t cmd, int dx, const uint8_t *data, int len, int max)
+{ // Encode a step as a whole frame (normal frame, no wake up bytes), target and checksum filled in on each run
+  if (!s)
+    return -PN532_ERR_NULL;
+  int n = 2 + dx + len; // TFI, command, target, data
+  if (s->steps >= PN532_SCRIPT_STEPS || len < 0 || (len && !data) || max < 0 || n > 0xFF || s->framelen + n + 7 > PN532_SCRIPT_BYTES || s->replylen + max > PN532_SCRIPT_BYTES)
+    return -PN532_ERR_SPACE;
+  pn532_script_step_t *t = &s->step[s->steps];
+  uint8_t *f = s->frames + s->framelen;
+  t->cmd = cmd;
+  t->dx = dx;
+  t->frame = s->framelen;
+  t->len = n + 7;
+  t->reply = s->replylen;
+  t->max = max;
+  *f++ = 0x00; // Preamble
+  *f++ = 0x00; // Start 1
+  *f++ = 0xFF; // Start 2
+  *f++ = n;
+  *f++ = -n;
+  *f++ = 0xD4;
+  *f++ = cmd;
+  if (dx)
+    *f++ = 1; // Target
+  if (len)
+    memcpy(f, data, len);
+  f += len;
+  *f++ = 0x00; // Checksum
+  *f++ = 0x00; // Postamble
+  s->framelen += t->len;
+  s->replylen += max;
+  return s->steps++;
+}
+
+static int pn532_script_slot(pn532_script_t *s, int step, int at, int from, int len)
+{
+  if (!s)
+    return -PN532_ERR_NULL;
+  if (step < 0 || step >= s->steps || s->slots >= PN532_SCRIPT_SLOTS || at < 0 || from < 0 || len < 0 || len > 0xFF)
+    return -PN532_ERR_SPACE;
+  pn532_script_step_t *t = &s->step[step];
+  if (at + (len ? len : 4) > t->len - 9 - t->dx)
+    return -PN532_ERR_SPACE; // Past end of step data
+  pn532_script_slot_t *o = &s->slot[s->slots++];
+  o->step = step;
+  o->len = len;
+  o->at = at;
+  o->from = from;
+  return 0;
+}
+
+void pn532_script_init(pn532_script_t *s)
+{
+  if (s)
+    memset(s, 0, sizeof(*s));
+}
+
+int pn532_script_cmd(pn532_script_t *s, uint8_t cmd, const uint8_t *data, int len, int max)
+{
+  return pn532_script_step(s, cmd, 0, data, len, max);
+}
+
+int pn532_script_dx(pn532_script_t *s, const uint8_t *data, int len, int max)
+{
+  return pn532_script_step(s, PN532_COMMAND_INDATAEXCHANGE, 1, data, len, max);
+}
+
+int pn532_script_param(pn532_script_t *s, int step, int at, int from, int len)
+{
+  if (len <= 0)
+    return -PN532_ERR_SPACE;
+  return pn532_script_slot(s, step, at, from, len);
+}
+
+int pn532_script_uid(pn532_script_t *s, int step, int at)
+{
+  return pn532_script_slot(s, step, at, 0, 0);
+}
+
+int pn532_script_ntag_write(pn532_script_t *s, uint8_t page, int from)
+{
+  uint8_t buf[6] = {MIFARE_ULTRALIGHT_CMD_WRITE, page};
+  int step = pn532_script_dx(s, buf, sizeof(buf), 0);
+  if (step >= 0)
+  {
+    int l = pn532_script_param(s, step, 2, from, 4);
+    if (l < 0)
+      return l;
+  }
+  return step;
+}
+
+int pn532_script_ntag_read(pn532_script_t *s, uint8_t page)
+{
+  uint8_t buf[2] = {MIFARE_CMD_READ, page};
+  return pn532_script_dx(s, buf, sizeof(buf), 16);
+}
+
+int pn532_script_classic_auth(pn532_script_t *s, uint8_t block, uint8_t keytype, const uint8_t key[6])
+{
+  uint8_t buf[12] = {keytype, block};
+  if (key)
+    memcpy(buf + 2, key, 6);
+  int step = pn532_script_dx(s, buf, sizeof(buf), 0);
+  if (step >= 0)
+  {
+    int l = pn532_script_uid(s, step, 8);
+    if (l < 0)
+      return l;
+  }
+  return step;
+}
+
+int pn532_script_classic_write(pn532_script_t *s, uint8_t block, int from)
+{
+  uint8_t buf[18] = {MIFARE_CMD_WRITE, block};
+  int step = pn532_script_dx(s, buf, sizeof(buf), 0);
+  if (step >= 0)
+  {
+    int l = pn532_script_param(s, step, 2, from, 16);
+    if (l < 0)
+      return l;
+  }
+  return step;
+}
+
+int pn532_script_run(pn532_t *p, pn532_script_t *s, const uint8_t *params, int *results)
+{ // Send each pre-encoded frame in turn under one hold of the reader, slots filled in on a copy so the script itself is not changed
+  if (!p)
+    return -PN532_ERR_NULL;
+  if (!s)
+    return -(p->lasterr = PN532_ERR_NULL);
+  int dx = 0;
+  for (int i = 0; i < s->steps; i++)
+    dx |= s->step[i].dx;
+  if (dx && !p->cards)
+    return -(p->lasterr = PN532_ERR_NOTPENDING); // No card
+  for (int i = 0; i < s->slots; i++)
+    if (s->slot[i].len && !params)
+      return -(p->lasterr = PN532_ERR_NULL);
+  if (p->lpdown)
+  { // Wake first, giving up if that fails
+    int l = pn532_resume(p);
+    if (l < 0)
+      return l;
+  }
+  int l = pn532_lock(p, PN532_PRIO_LOW),
+      i;
+  if (l < 0)
+    return l;
+  for (i = 0; i < s->steps; i++)
+  {
+    pn532_script_step_t *t = &s->step[i];
+    uint8_t f[0xFF + 7], // Frame for this run
+        sum = 0;
+    memcpy(f, s->frames + t->frame, t->len);
+    for (int j = 0; j < s->slots && l >= 0; j++)
+    {
+      pn532_script_slot_t *o = &s->slot[j];
+      if (o->step != i)
+        continue;
+      if (o->len)
+        memcpy(f + 7 + t->dx + o->at, params + o->from, o->len);
+      else if (p->nfcid[0] < 4)
+        l = -(p->lasterr = PN532_ERR_SHORT);
+      else
+        memcpy(f + 7 + t->dx + o->at, p->nfcid + 1, 4); // Card UID
+    }
+    if (l < 0)
+    {
+      if (results)
+        results[i] = l;
+      break;
+    }
+    if (t->dx)
+      f[7] = p->tg;
+    for (int j = 5; j < t->len - 2; j++)
+      sum += f[j];
+    f[t->len - 2] = -sum;
+    pn532_tx_raw(p, f, t->len);
+    l = pn532_tx_ack(p, t->cmd, t->len - 7);
+    if (l >= 0)
+    { // A short reply space is received via the response buffer (free, as nothing is started while the reader is held), so a longer reply than kept fails the step rather than the link
+      uint8_t status = 0,
+              *r = s->replies + t->reply,
+              *rx = t->max < (int)sizeof(p->frame) ? p->frame : r;
+      l = pn532_rx_mutex(p, t->dx, &status, rx == r ? t->max : (int)sizeof(p->frame), rx, t->dx ? 500 : 100);
+      if (t->dx && !l)
+        l = -(p->lasterr = PN532_ERR_SHORT);
+      else if (t->dx && l > 0 && status)
+        l = -(p->lasterr = PN532_ERR_STATUS + (status & 0x3F));
+      else if (t->dx && l > 0)
+        l--; // Allow for status
+      if (l > t->max)
+        l = -(p->lasterr = PN532_ERR_SPACE); // Reply longer than step keeps
+      else if (l > 0 && rx != r)
+        memcpy(r, rx, l);
+    }
+    else
+      pn532_failed(p, l);
+    if (results)
+      results[i] = l;
+    if (l < 0)
+      break; // Early abort
+  }
+  xSemaphoreGive(p->mutex);
+  if (l < 0)
+  {
+    while (results && ++i < s->steps)
+      results[i] = -PN532_ERR_ABORTED; // Not run
+    return l;
+  }
+  return s->steps;
+}
+
+uint8_t *pn532_script_reply(pn532_script_t *s, int step)
+{
+  if (!s || step < 0 || step >= s->steps)
+    return NULL;
+  return s->replies + s->step[step].reply;
+}
+
 /***** NTAG2xx Functions ******/
 
 /**************************************************************************/
@@ -913,10 +3244,60 @@ int pn532_ntag2xx_WritePage(pn532_t *obj, uint8_t page, uint8_t *data)
   return pn532_dx(obj, 6, pn532_packetbuffer, 26, NULL);
 }
 
+int pn532_ntag2xx_max_page(pn532_t *obj)
+{ // Last user page, from card identification
+  const pn532_family_desc_t *f = pn532_identify(obj);
+  if (!(f->fast & PN532_FAST_READ16))
+    return 0; // Not Type 2
+  return f->last;
+}
+
+int pn532_ntag2xx_ReadPages(pn532_t *obj, uint8_t page, uint8_t count, uint8_t *buffer)
+{ // Read count pages, FAST_READ if the card has it, else READ 4 pages at a time, returns pages read
+  if (!obj)
+    return -PN532_ERR_NULL;
+  const pn532_family_desc_t *f = pn532_identify(obj);
+  int done = 0;
+  while (done < count)
+  {
+    int n = count - done,
+        l;
+    if (f->fast & PN532_FAST_FASTREAD)
+    { // Up to 60 pages per frame
+      if (n > 60)
+        n = 60;
+      buffer[done * 4] = 0x3A;
+      buffer[done * 4 + 1] = page + done;
+      buffer[done * 4 + 2] = page + done + n - 1;
+      l = pn532_thru(obj, 3, buffer + done * 4, n * 4);
+    }
+    else
+    { // READ gives 4 pages
+      uint8_t buf[16];
+      buf[0] = MIFARE_CMD_READ;
+      buf[1] = page + done;
+      l = pn532_dx(obj, 2, buf, sizeof(buf), NULL);
+      if (n > 4)
+        n = 4;
+      if (l >= n * 4)
+        memcpy(buffer + done * 4, buf, n * 4);
+    }
+    if (l < 0)
+      return l;
+    if (l < n * 4)
+      return -(obj->lasterr = PN532_ERR_SHORT);
+    done += n;
+  }
+  return done;
+}
+
 void pn532_ntag2xx_erase(pn532_t *obj, uint8_t ntag_max_page)
 {
   uint8_t blank[4] = {0};
 
+  if (!ntag_max_page)
+    ntag_max_page = pn532_ntag2xx_max_page(obj);
+
   for (uint8_t page = 4; page < ntag_max_page + 1; page++)
   {
     pn532_ntag2xx_WritePage(obj, page, blank);
@@ -0,0 +1,364 @@
+/**
+ * @file pn532.hpp
+ * @brief PN532 C++20 coroutine API
+ *
+ * Each PN532 exchange is an awaitable that suspends the calling coroutine
+ * until the response frame arrives, using the non-blocking pn532_start /
+ * pn532_poll / pn532_collect path. An executor steps every suspended exchange
+ * on every reader from one task (a FreeRTOS task on target, a plain loop on
+ * Linux), so multi-step card flows on several readers need no thread each.
+ *
+ * Awaitables live in the coroutine frame and nothing is allocated per await.
+ * The frame itself is allocated once, when the task is created.
+ */
+
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <type_traits>
+#include <utility>
+
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "pn532.h"
+
+#ifndef ESP_PLATFORM
+#include <unistd.h>
+#endif
+
+namespace pn532
+{
+
+class executor;
+
+// Suspended await, linked in to the executor's wait list
+class op
+{
+public:
+  virtual bool step(uint32_t now) = 0; // Advance, true when done
+
+protected:
+  ~op() = default;
+  friend class executor;
+  op *next = nullptr;
+  std::coroutine_handle<> h; // Coroutine to resume when done
+};
+
+struct promise_base
+{
+  executor *exec = nullptr;
+  std::coroutine_handle<> self;
+  std::coroutine_handle<> cont; // Awaiting coroutine (none if spawned)
+  promise_base *next = nullptr; // Executor task list
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  struct final_awaiter
+  { // Carry on with whoever awaited us, if anyone
+    bool await_ready() noexcept { return false; }
+    template <class P> std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+    {
+      std::coroutine_handle<> c = h.promise().cont;
+      return c ? c : std::noop_coroutine();
+    }
+    void await_resume() noexcept {}
+  };
+  final_awaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception() { std::terminate(); }
+};
+
+template <typename T = void> class task;
+
+template <typename T> struct promise : promise_base
+{
+  T value{};
+  task<T> get_return_object();
+  void return_value(T v) { value = std::move(v); }
+};
+
+template <> struct promise<void> : promise_base
+{
+  task<void> get_return_object();
+  void return_void() {}
+};
+
+// Coroutine returning T, started by co_await from another task or by
+// executor::spawn
+template <typename T> class task
+{
+public:
+  using promise_type = promise<T>;
+  using handle = std::coroutine_handle<promise_type>;
+  explicit task(handle h) : h(h) {}
+  task(task &&t) noexcept : h(std::exchange(t.h, {})) {}
+  task(const task &) = delete;
+  task &operator=(const task &) = delete;
+  ~task()
+  {
+    if (h)
+      h.destroy();
+  }
+  bool await_ready() const noexcept { return false; }
+  template <class P> std::coroutine_handle<> await_suspend(std::coroutine_handle<P> c) noexcept
+  { // Run on the same executor, coming back here when done
+    h.promise().exec = c.promise().exec;
+    h.promise().cont = c;
+    return h;
+  }
+  T await_resume()
+  {
+    if constexpr (!std::is_void_v<T>)
+      return std::move(h.promise().value);
+  }
+  handle release() { return std::exchange(h, {}); }
+
+private:
+  handle h;
+};
+
+template <typename T> task<T> promise<T>::get_return_object()
+{
+  self = std::coroutine_handle<promise<T>>::from_promise(*this);
+  return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void> promise<void>::get_return_object()
+{
+  self = std::coroutine_handle<promise<void>>::from_promise(*this);
+  return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+// Runs spawned tasks, stepping every suspended await once per pass
+class executor
+{
+public:
+  void spawn(task<void> t); // Run t (executor owns it now), safe from any task
+  bool run_once();          // One pass, false when no tasks left
+  void run()
+  { // Until all spawned tasks are done (Linux event loop)
+    while (run_once())
+      ;
+  }
+  bool start(const char *name = "pn532", uint32_t stack = 4096,
+             UBaseType_t prio = 5); // Run for ever on a FreeRTOS task
+  void wait(op *o)
+  {
+    o->next = waiting;
+    waiting = o;
+  }
+  static uint32_t now() { return esp_timer_get_time() / 1000; } // ms
+
+private:
+  static void idle()
+  { // Nothing completed this pass, let bytes arrive
+#ifdef ESP_PLATFORM
+    vTaskDelay(1);
+#else
+    usleep(1000);
+#endif
+  }
+  op *waiting = nullptr;
+  promise_base *tasks = nullptr;
+  promise_base *incoming = nullptr; // Spawned, not started
+  portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+};
+
+inline void executor::spawn(task<void> t)
+{
+  promise_base *p = &t.release().promise();
+  p->exec = this;
+  portENTER_CRITICAL(&mux);
+  p->next = incoming;
+  incoming = p;
+  portEXIT_CRITICAL(&mux);
+}
+
+inline bool executor::run_once()
+{
+  bool busy = false;
+  portENTER_CRITICAL(&mux);
+  promise_base *in = incoming;
+  incoming = nullptr;
+  portEXIT_CRITICAL(&mux);
+  while (in)
+  { // Start new tasks
+    promise_base *t = in;
+    in = in->next;
+    t->next = tasks;
+    tasks = t;
+    t->self.resume();
+    busy = true;
+  }
+  uint32_t now = executor::now();
+  op *ready = nullptr,
+     **tail = &ready;
+  for (op **o = &waiting; *o;)
+    if ((*o)->step(now))
+    { // Done, resume after the scan as resuming adds to the wait list
+      op *d = *o;
+      *o = d->next;
+      d->next = nullptr;
+      *tail = d;
+      tail = &d->next;
+    }
+    else
+      o = &(*o)->next;
+  while (ready)
+  {
+    op *o = ready;
+    ready = o->next; // Before resume, which ends the await holding o
+    o->h.resume();
+    busy = true;
+  }
+  for (promise_base **t = &tasks; *t;)
+    if ((*t)->self.done())
+    {
+      promise_base *d = *t;
+      *t = d->next;
+      d->self.destroy();
+    }
+    else
+      t = &(*t)->next;
+  if (!busy)
+    idle();
+  portENTER_CRITICAL(&mux);
+  bool more = (tasks || incoming);
+  portEXIT_CRITICAL(&mux);
+  return more;
+}
+
+inline bool executor::start(const char *name, uint32_t stack, UBaseType_t prio)
+{
+  auto loop = [](void *arg)
+  {
+    executor *e = static_cast<executor *>(arg);
+    for (;;)
+      e->run_once();
+  };
+  return xTaskCreate(loop, name, stack, this, prio, NULL) == pdPASS;
+}
+
+// PN532 exchange - begin() starts the non-blocking command and finish()
+// collects it once pn532_poll says done, co_await returns finish() or the
+// error. Starting is retried, up to the timeout, while the reader is busy with
+// another command (another coroutine, or a blocking call on another task). A
+// powered down reader fails at once with PN532_ERR_ASLEEP (pn532_resume first)
+class exchange : public op
+{
+public:
+  bool await_ready() const noexcept { return false; }
+  template <class P> bool await_suspend(std::coroutine_handle<P> c)
+  {
+    if (step(executor::now()))
+      return false; // Done already, no need to suspend
+    h = c;
+    c.promise().exec->wait(this);
+    return true;
+  }
+  int await_resume() const noexcept { return result; }
+  bool step(uint32_t now) override
+  {
+    if (!started)
+    {
+      if (!timing)
+      { // Busy timeout from first try
+        timing = true;
+        since = now;
+      }
+      int l = begin(now);
+      if (l == -PN532_ERR_CMDPENDING && (int32_t)(now - since) < ms)
+        return false; // Reader busy, try again next pass
+      if (l < 0)
+      {
+        result = l;
+        return true;
+      }
+      started = true;
+    }
+    if (pn532_poll(p, now) == PN532_POLL_BUSY)
+      return false;
+    result = finish();
+    return true;
+  }
+
+protected:
+  exchange(pn532_t *p, int ms) : p(p), ms(ms) {}
+  ~exchange() = default;
+  virtual int begin(uint32_t now) = 0;
+  virtual int finish() = 0;
+  pn532_t *p;
+  int ms;
+  int result = 0;
+  bool started = false;
+  bool timing = false;
+  uint32_t since = 0;
+};
+
+// Any PN532 command (cmd code), response data (after response code) in to res
+class command final : public exchange
+{
+public:
+  command(pn532_t *p, uint8_t cmd, int len, uint8_t *data, int max, uint8_t *res, int ms = 100)
+      : exchange(p, ms), cmd(cmd), len(len), data(data), max(max), res(res)
+  {
+  }
+
+private:
+  int begin(uint32_t now) override { return pn532_start(p, now, ms, cmd, len, data, 0, NULL); }
+  int finish() override { return pn532_collect(p, max, res, 0, NULL); }
+  uint8_t cmd;
+  int len;
+  uint8_t *data;
+  int max;
+  uint8_t *res;
+};
+
+// Card exchange as pn532_dx - sends len bytes of data, reply in to data
+class dx final : public exchange
+{
+public:
+  dx(pn532_t *p, unsigned int len, uint8_t *data, unsigned int max)
+      : exchange(p, 500), len(len), data(data), max(max)
+  {
+  }
+
+private:
+  int begin(uint32_t now) override { return pn532_dx_start(p, now, len, data); }
+  int finish() override { return pn532_dx_collect(p, max, data); }
+  unsigned int len;
+  uint8_t *data;
+  unsigned int max;
+};
+
+// InListPassiveTarget for type last set up, returns as pn532_Cards
+class cards final : public exchange
+{
+public:
+  explicit cards(pn532_t *p) : exchange(p, 110) {}
+
+private:
+  int begin(uint32_t now) override { return pn532_ILPT_Start(p, now); }
+  int finish() override { return pn532_Cards(p); }
+};
+
+// Wait ms without holding the executor
+class sleep final : public op
+{
+public:
+  explicit sleep(uint32_t ms) : ms(ms) {}
+  bool await_ready() const noexcept { return !ms; }
+  template <class P> void await_suspend(std::coroutine_handle<P> c)
+  {
+    until = executor::now() + ms;
+    h = c;
+    c.promise().exec->wait(this);
+  }
+  void await_resume() const noexcept {}
+  bool step(uint32_t now) override { return (int32_t)(now - until) >= 0; }
+
+private:
+  uint32_t ms;
+  uint32_t until = 0;
+};
+
+} // namespace pn532
@@ -0,0 +1,18 @@
+// Host stand in for ESP-IDF driver/gpio.h
+#pragma once
+#include "esp_err.h"
+
+typedef int gpio_num_t;
+
+typedef enum {
+  GPIO_DRIVE_CAP_0,
+  GPIO_DRIVE_CAP_1,
+  GPIO_DRIVE_CAP_2,
+  GPIO_DRIVE_CAP_3,
+} gpio_drive_cap_t;
+
+#define GPIO_IS_VALID_GPIO(n) ((n) >= 0 && (n) < 40)
+#define GPIO_IS_VALID_OUTPUT_GPIO(n) ((n) >= 0 && (n) < 34)
+
+esp_err_t gpio_reset_pin(gpio_num_t);
+esp_err_t gpio_set_drive_capability(gpio_num_t, gpio_drive_cap_t);
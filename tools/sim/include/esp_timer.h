@@ -0,0 +1,13 @@
+// Host stand in for ESP-IDF esp_timer.h
+#pragma once
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int64_t esp_timer_get_time(void); // Monotonic us since start
+
+#ifdef __cplusplus
+}
+#endif
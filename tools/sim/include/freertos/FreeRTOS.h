@@ -0,0 +1,44 @@
+// Host stand in for FreeRTOS (pthreads), enough for the PN532 driver
+#pragma once
+#include <pthread.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t StackType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+#define portMAX_DELAY ((TickType_t)0xFFFFFFFF)
+#ifndef portTICK_PERIOD_MS
+#define portTICK_PERIOD_MS 10 // As ESP-IDF default CONFIG_FREERTOS_HZ 100
+#endif
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms) / portTICK_PERIOD_MS)
+
+typedef struct {
+  int unused;
+} portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED {0}
+void vPortEnterCritical(portMUX_TYPE *); // One host wide lock
+void vPortExitCritical(portMUX_TYPE *);
+#define portENTER_CRITICAL(mux) vPortEnterCritical(mux)
+#define portEXIT_CRITICAL(mux) vPortExitCritical(mux)
+
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int count;
+} StaticSemaphore_t;
+
+#ifdef __cplusplus
+}
+#endif
+
+#include "freertos/task.h"
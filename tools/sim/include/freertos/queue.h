@@ -0,0 +1,11 @@
+// Host stand in for FreeRTOS queue.h
+#pragma once
+#include "freertos/FreeRTOS.h"
+
+typedef struct QueueDefinition *QueueHandle_t;
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t size);
+void vQueueDelete(QueueHandle_t);
+BaseType_t xQueueSend(QueueHandle_t, const void *, TickType_t);
+BaseType_t xQueueReceive(QueueHandle_t, void *, TickType_t);
+BaseType_t xQueueReset(QueueHandle_t);
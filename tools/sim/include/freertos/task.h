@@ -0,0 +1,18 @@
+// Host stand in for FreeRTOS task.h
+#pragma once
+#include "freertos/FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef pthread_t TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+void vTaskDelay(TickType_t);
+TickType_t xTaskGetTickCount(void);
+BaseType_t xTaskCreate(TaskFunction_t, const char *, uint32_t, void *, UBaseType_t, TaskHandle_t *);
+
+#ifdef __cplusplus
+}
+#endif
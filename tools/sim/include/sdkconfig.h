@@ -0,0 +1,2 @@
+// Host build of the PN532 driver against the virtual PN532 (tools/sim)
+#pragma once
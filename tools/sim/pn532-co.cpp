@@ -0,0 +1,157 @@
+// Coroutine example against the virtual PN532
+// One executor runs a card reading flow (poll, read, wait for removal) and an
+// LED blinker sharing the same reader, with no thread for either
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "pn532-sim.h"
+#include "pn532.hpp"
+
+struct co_stats
+{
+  uint32_t detected;
+  uint32_t reads;
+  uint32_t readfails;
+  uint32_t exchanges;
+  uint64_t tap_us; // Total tap to UID
+  uint32_t max_tap_us;
+  uint32_t blinks;
+  uint32_t max_gap_ms; // Worst blinker lateness
+};
+
+static pn532::task<int> co_read(pn532_t *p, co_stats &s)
+{ // Read the card as pn532-load does, returns -ve on error
+  const pn532_family_desc_t *f = pn532_family(p);
+  uint8_t buf[64];
+  int l = -1;
+  switch (f ? f->family : PN532_FAMILY_UNKNOWN)
+  {
+  case PN532_FAMILY_TYPE2:
+  case PN532_FAMILY_ULTRALIGHT:
+  case PN532_FAMILY_NTAG203:
+  case PN532_FAMILY_NTAG213:
+  case PN532_FAMILY_NTAG215:
+  case PN532_FAMILY_NTAG216:
+    buf[0] = 0x30; // READ 4 pages
+    buf[1] = 4;
+    l = co_await pn532::dx(p, 2, buf, sizeof(buf));
+    s.exchanges++;
+    break;
+  case PN532_FAMILY_CLASSIC_1K:
+  {
+    uint8_t *id = pn532_nfcid(p, NULL);
+    buf[0] = 0x60; // Auth key A
+    buf[1] = 4;
+    memset(buf + 2, 0xFF, 6);
+    memcpy(buf + 8, id + 1, 4);
+    l = co_await pn532::dx(p, 12, buf, sizeof(buf));
+    s.exchanges++;
+    if (l >= 0)
+    {
+      buf[0] = 0x30;
+      buf[1] = 4;
+      l = co_await pn532::dx(p, 2, buf, sizeof(buf));
+      s.exchanges++;
+    }
+    break;
+  }
+  case PN532_FAMILY_DESFIRE:
+    buf[0] = 0x60; // GetVersion, three parts
+    l = co_await pn532::dx(p, 1, buf, sizeof(buf));
+    s.exchanges++;
+    for (int i = 0; i < 2 && l > 0 && buf[0] == 0xAF; i++)
+    {
+      buf[0] = 0xAF;
+      l = co_await pn532::dx(p, 1, buf, sizeof(buf));
+      s.exchanges++;
+    }
+    break;
+  default:
+    break;
+  }
+  co_return l;
+}
+
+static pn532::task<> co_reader(pn532_t *p, uint32_t end, co_stats &s)
+{
+  uint32_t lasttap = 0;
+  while ((int32_t)(pn532::executor::now() - end) < 0)
+  {
+    int n = co_await pn532::cards(p);
+    int64_t since;
+    uint32_t which;
+    if (n <= 0 || pn532_sim_present(&since, &which) < 0 || which == lasttap)
+      continue;
+    lasttap = which; // New tap
+    uint32_t us = esp_timer_get_time() - since;
+    s.detected++;
+    s.tap_us += us;
+    if (us > s.max_tap_us)
+      s.max_tap_us = us;
+    if (co_await co_read(p, s) < 0)
+      s.readfails++;
+    else
+      s.reads++;
+    while ((int32_t)(pn532::executor::now() - end) < 0 && co_await pn532::cards(p) > 0)
+      co_await pn532::sleep(20); // Wait for card to go
+  }
+}
+
+static pn532::task<> co_blink(pn532_t *p, uint32_t end, co_stats &s)
+{ // LED on P30 every 50ms, between the reader's commands
+  uint8_t led = 0;
+  uint32_t due = pn532::executor::now();
+  while ((int32_t)(pn532::executor::now() - end) < 0)
+  {
+    due += 50;
+    int32_t wait = due - pn532::executor::now();
+    co_await pn532::sleep(wait > 0 ? wait : 0);
+    uint32_t late = pn532::executor::now() - due;
+    if (late > s.max_gap_ms)
+      s.max_gap_ms = late;
+    uint8_t gpio[2] = {(uint8_t)(0x80 | (led ^= 1)), 0x80}; // WriteGPIO, the driver updates its P3/P7 shadow when done
+    if (co_await pn532::command(p, 0x0E, sizeof(gpio), gpio, 0, NULL) >= 0)
+      s.blinks++;
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  int secs = 10;
+  int c;
+  while ((c = getopt(argc, argv, "t:")) >= 0)
+    switch (c)
+    {
+    case 't':
+      secs = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "pn532-co [-t secs]\n");
+      return 2;
+    }
+  for (int t = 0; t <= PN532_SIM_DESFIRE; t++)
+    pn532_sim_add((pn532_sim_card_t)t, NULL, 0); // Type A, as pn532::cards polls
+  pn532_t *p = pn532_init(1, 4, 17, 16, 0);
+  if (!p)
+  {
+    fprintf(stderr, "pn532_init failed\n");
+    return 1;
+  }
+  pn532_sim_schedule(150, 100);
+  co_stats s = {};
+  uint32_t start = pn532::executor::now(),
+           end = start + secs * 1000;
+  pn532::executor e;
+  e.spawn(co_reader(p, end, s));
+  e.spawn(co_blink(p, end, s));
+  e.run();
+  double run = (pn532::executor::now() - start) / 1000.0;
+  pn532_sim_stats_t sim;
+  pn532_sim_stats(&sim);
+  printf("taps       %u in %.1fs, detected %u (%.2f/s), reads ok %u failed %u, exchanges %u\n", sim.taps, run, s.detected, s.detected / run,
+         s.reads, s.readfails, s.exchanges);
+  printf("tap-uid    mean=%u max=%u us\n", s.detected ? (uint32_t)(s.tap_us / s.detected) : 0, s.max_tap_us);
+  printf("blinker    %u writes, worst lateness %u ms\n", s.blinks, s.max_gap_ms);
+  return 0;
+}
@@ -0,0 +1,424 @@
+// Load test of the PN532 driver against the virtual PN532
+// Taps virtual cards on a schedule, reads each one, and reports taps/sec,
+// tap to UID and exchange latency percentiles, and recovery under faults
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "pn532-sim.h"
+#include "pn532.h"
+
+typedef struct
+{
+  const char *name;
+  int64_t *us;
+  int n;
+  int max;
+} load_lat_t;
+
+static void load_add(load_lat_t *l, int64_t us)
+{
+  if (l->n == l->max)
+  {
+    l->max = (l->max ? l->max * 2 : 1024);
+    l->us = realloc(l->us, l->max * sizeof(*l->us));
+    if (!l->us)
+      exit(2);
+  }
+  l->us[l->n++] = us;
+}
+
+static int load_cmp(const void *a, const void *b)
+{
+  int64_t x = *(const int64_t *)a,
+          y = *(const int64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static void load_report(load_lat_t *l)
+{
+  if (!l->n)
+  {
+    printf("%-10s none\n", l->name);
+    return;
+  }
+  qsort(l->us, l->n, sizeof(*l->us), load_cmp);
+  printf("%-10s n=%-6d p50=%-7lld p90=%-7lld p99=%-7lld max=%-7lld us\n", l->name, l->n,
+         (long long)l->us[l->n * 50 / 100], (long long)l->us[l->n * 90 / 100], (long long)l->us[l->n * 99 / 100], (long long)l->us[l->n - 1]);
+}
+
+static int load_card(pn532_t *p, load_lat_t *ex)
+{ // Read the card as an application would, returns -ve on error
+  const pn532_family_desc_t *f = pn532_identify(p);
+  if (!f)
+    return -1;
+  uint8_t buf[64];
+  int64_t t = esp_timer_get_time();
+  int l = -1;
+  switch (f->family)
+  {
+  case PN532_FAMILY_NTAG213:
+  case PN532_FAMILY_NTAG215:
+  case PN532_FAMILY_NTAG216:
+  case PN532_FAMILY_ULTRALIGHT:
+  case PN532_FAMILY_NTAG203:
+  case PN532_FAMILY_TYPE2:
+    l = pn532_ntag2xx_ReadPages(p, 4, 12, buf);
+    break;
+  case PN532_FAMILY_CLASSIC_1K:
+  {
+    uint8_t *id = pn532_nfcid(p, NULL);
+    buf[0] = 0x60; // Auth key A
+    buf[1] = 4;
+    memset(buf + 2, 0xFF, 6);
+    memcpy(buf + 8, id + 1, 4);
+    l = pn532_dx(p, 12, buf, sizeof(buf), NULL);
+    if (l >= 0)
+    {
+      load_add(ex, esp_timer_get_time() - t);
+      t = esp_timer_get_time();
+      buf[0] = 0x30;
+      buf[1] = 4;
+      l = pn532_dx(p, 2, buf, sizeof(buf), NULL);
+    }
+    break;
+  }
+  case PN532_FAMILY_ISO14443B:
+  { // SELECT the NDEF application
+    static const uint8_t sel[] = {0x00, 0xA4, 0x04, 0x00, 0x07, 0xD2, 0x76, 0x00, 0x00, 0x85, 0x01, 0x01, 0x00};
+    memcpy(buf, sel, sizeof(sel));
+    l = pn532_dx(p, sizeof(sel), buf, sizeof(buf), NULL);
+    if (l >= 0 && (l < 2 || buf[l - 2] != 0x90))
+      l = -1;
+    break;
+  }
+  case PN532_FAMILY_FELICA:
+  case PN532_FAMILY_JEWEL:
+    return 0; // UID only
+  case PN532_FAMILY_DESFIRE:
+    buf[0] = 0x60; // GetVersion, three parts
+    l = pn532_dx(p, 1, buf, sizeof(buf), NULL);
+    for (int i = 0; i < 2 && l > 0 && buf[0] == 0xAF; i++)
+    {
+      load_add(ex, esp_timer_get_time() - t);
+      t = esp_timer_get_time();
+      buf[0] = 0xAF;
+      l = pn532_dx(p, 1, buf, sizeof(buf), NULL);
+    }
+    break;
+  default:
+    break;
+  }
+  if (l >= 0)
+    load_add(ex, esp_timer_get_time() - t);
+  return l;
+}
+
+static int load_encode(pn532_t *p, int pages, int script, uint32_t tap)
+{ // Write pages from 4 with data for this card and check the first, as an encoding line would
+  static pn532_script_t sc;
+  static int built = 0;
+  uint8_t params[4 * 64];
+  for (int i = 0; i < pages * 4; i++)
+    params[i] = tap + i;
+  if (script)
+  {
+    if (!built)
+    {
+      pn532_script_init(&sc);
+      for (int i = 0; i < pages; i++)
+        pn532_script_ntag_write(&sc, 4 + i, i * 4);
+      if (pn532_script_ntag_read(&sc, 4) < 0)
+        exit(2);
+      built = 1;
+    }
+    int results[PN532_SCRIPT_STEPS];
+    if (pn532_script_run(p, &sc, params, results) < 0)
+      return -1;
+    return memcmp(pn532_script_reply(&sc, pages), params, 4) ? -1 : 0;
+  }
+  for (int i = 0; i < pages; i++)
+    if (pn532_ntag2xx_WritePage(p, 4 + i, params + i * 4) < 0)
+      return -1;
+  uint8_t buf[16] = {MIFARE_CMD_READ, 4};
+  if (pn532_dx(p, 2, buf, sizeof(buf), NULL) < 4)
+    return -1;
+  return memcmp(buf, params, 4) ? -1 : 0;
+}
+
+static int load_apdu(void *arg, const uint8_t *apdu, int len, uint8_t *res, int max)
+{ // Emulated card, a file read by READ BINARY once selected
+  int l = 0;
+  if (len >= 2 && apdu[1] == 0xA4)
+    ; // SELECT
+  else if (len >= 5 && apdu[1] == 0xB0 && apdu[4] + 2 <= max)
+    for (int i = 0; i < apdu[4]; i++)
+      res[l++] = apdu[3] + i; // READ BINARY
+  else
+  {
+    res[l++] = 0x6D; // Not supported
+    res[l++] = 0x00;
+    return l;
+  }
+  res[l++] = 0x90;
+  res[l++] = 0x00;
+  return l;
+}
+
+static int load_target(pn532_t *p, int secs, int apdus, int gap)
+{ // Target mode against the virtual phone
+  static pn532_target_t tg;
+  static const uint8_t nfcid[3] = {0x12, 0x34, 0x56};
+  pn532_target_init(&tg, nfcid, NULL, 0, load_apdu, NULL);
+  pn532_sim_phone(apdus, gap);
+  int64_t start = esp_timer_get_time(),
+          end = start + secs * 1000000LL;
+  uint32_t errors = 0;
+  while (esp_timer_get_time() < end)
+    if (pn532_target(p, &tg, 200) < 0)
+      errors++;
+  double run = (esp_timer_get_time() - start) / 1000000.0;
+  pn532_target_stats_t s;
+  pn532_target_stats(&tg, &s);
+  pn532_sim_stats_t sim;
+  pn532_sim_stats(&sim);
+  printf("target     sessions %u (%.2f/s) apdus %u released %u errors %u\n", s.sessions, s.sessions / run, s.apdus, s.releases, s.errors);
+  printf("handler    mean=%u max=%u us\n", s.apdus ? (uint32_t)(s.total_handler_us / s.apdus) : 0, s.max_handler_us);
+  printf("turnaround mean=%u max=%u us (APDU in to response sent)\n", s.apdus ? (uint32_t)(s.total_turn_us / s.apdus) : 0, s.max_turn_us);
+  printf("phone      sessions %u apdus %u bad SW %u wait mean=%u max=%u us\n", sim.sessions, sim.apdus, sim.bad_sw,
+         sim.apdus ? (uint32_t)(sim.turn_us / sim.apdus) : 0, sim.max_turn_us);
+  return errors ? 1 : 0;
+}
+
+static void load_usage(void)
+{
+  fprintf(stderr, "pn532-load [options]\n"
+                  " -t secs      run time (10)\n"
+                  " -b baud      UART speed code 0-8 (4 = 115200)\n"
+                  " -c cards     card list, of ntag213,ntag215,ntag216,ntag203,classic,desfire,typeb,\n"
+                  "              felica,jewel\n"
+                  "              (ntag213,classic,desfire)\n"
+                  " -p ms        card present time per tap (150)\n"
+                  " -a ms        card absent time between taps (100)\n"
+                  " -e ber       bit error rate PN532 to host (0)\n"
+                  " -d chance    frame drop chance (0)\n"
+                  " -x chance    error frame chance (0)\n"
+                  " -r profile   RF profile 0-3 (0)\n"
+                  " -s seed      fault seed (1)\n"
+                  " -m rate      exit 1 if taps/sec detected below rate\n"
+                  " -l ms        low power detection, PowerDown and sleep ms between polls\n"
+                  " -w pages     write pages to each card (NTAG) rather than read it\n"
+                  " -S           use a card script for -w\n"
+                  " -T apdus     target mode, virtual phone sends apdus per session (-a ms apart)\n"
+                  " -P protos    multi-protocol poll cycle, mask of A=1 B=2 FeliCa212=4 FeliCa424=8 Jewel=16\n"
+                  " -F           fixed poll order for -P (no adapting)\n"
+                  " -v           driver logging\n");
+  exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+  int secs = 10,
+      baud = 4,
+      present = 150,
+      absent = 100,
+      profile = 0,
+      lp = 0,
+      target = 0,
+      pages = 0,
+      script = 0,
+      protos = 0,
+      adaptive = 1;
+  double min = 0;
+  const char *cards = "ntag213,classic,desfire";
+  pn532_sim_config_t cfg;
+  pn532_sim_config_get(&cfg);
+  int c;
+  while ((c = getopt(argc, argv, "t:b:c:p:a:e:d:x:r:s:m:l:T:w:SP:Fv")) >= 0)
+    switch (c)
+    {
+    case 't':
+      secs = atoi(optarg);
+      break;
+    case 'b':
+      baud = atoi(optarg);
+      break;
+    case 'c':
+      cards = optarg;
+      break;
+    case 'p':
+      present = atoi(optarg);
+      break;
+    case 'a':
+      absent = atoi(optarg);
+      break;
+    case 'e':
+      cfg.ber = atof(optarg);
+      break;
+    case 'd':
+      cfg.drop = atof(optarg);
+      break;
+    case 'x':
+      cfg.error = atof(optarg);
+      break;
+    case 'r':
+      profile = atoi(optarg);
+      break;
+    case 's':
+      cfg.seed = atoi(optarg);
+      break;
+    case 'm':
+      min = atof(optarg);
+      break;
+    case 'l':
+      lp = atoi(optarg);
+      break;
+    case 'w':
+      pages = atoi(optarg);
+      if (pages < 1 || pages > PN532_SCRIPT_STEPS - 1)
+        load_usage();
+      break;
+    case 'S':
+      script = 1;
+      break;
+    case 'T':
+      target = atoi(optarg);
+      break;
+    case 'P':
+      protos = strtol(optarg, NULL, 0);
+      break;
+    case 'F':
+      adaptive = 0;
+      break;
+    case 'v':
+      esp_log_host_level = ESP_LOG_DEBUG;
+      break;
+    default:
+      load_usage();
+    }
+  static const char *const names[PN532_SIM_MAX] = {"ntag213", "ntag215", "ntag216", "ntag203", "classic", "desfire", "typeb", "felica", "jewel"};
+  char *list = strdup(cards);
+  for (char *s = strtok(list, ","); s; s = strtok(NULL, ","))
+  {
+    int t = 0;
+    while (t < PN532_SIM_MAX && strcmp(s, names[t]))
+      t++;
+    if (t == PN532_SIM_MAX || pn532_sim_add(t, NULL, 0) < 0)
+      load_usage();
+  }
+  free(list);
+  pn532_t *p = pn532_init(1, baud, 17, 16, 0);
+  if (!p)
+  {
+    fprintf(stderr, "pn532_init failed\n");
+    return 1;
+  }
+  if (pn532_rf_profile(p, profile) < 0)
+  {
+    fprintf(stderr, "pn532_rf_profile failed %s\n", pn532_err_to_name(pn532_lasterr(p)));
+    return 1;
+  }
+  // Faults only once set up, init itself is not what is being measured
+  pn532_sim_config(&cfg);
+  if (target)
+    return load_target(p, secs, target, absent);
+  static pn532_multi_t multi;
+  if (protos && pn532_multi_config(&multi, protos, 0, 0xFFFF, adaptive) <= 0)
+    load_usage();
+  pn532_sim_schedule(present, absent);
+  load_lat_t tap = {"tap-uid"},
+             ex = {"exchange"},
+             poll = {"poll"},
+             enc = {"encode"};
+  uint32_t lasttap = 0,
+           detected = 0,
+           reads = 0,
+           readfails = 0,
+           errors = 0;
+  int64_t start = esp_timer_get_time(),
+          end = start + secs * 1000000LL;
+  while (esp_timer_get_time() < end)
+  {
+    int64_t t = esp_timer_get_time();
+    int n = (lp ? pn532_lp_detect(p) : protos ? pn532_multi_poll(p, &multi) : pn532_Cards(p));
+    if (n < 0)
+    {
+      errors++;
+      continue;
+    }
+    load_add(&poll, esp_timer_get_time() - t);
+    if (lp && !n)
+    { // Powered down, host sleeps too
+      usleep(lp * 1000);
+      continue;
+    }
+    int64_t since;
+    uint32_t which;
+    if (n <= 0 || pn532_sim_present(&since, &which) < 0 || which == lasttap)
+      continue;
+    lasttap = which; // New tap
+    detected++;
+    load_add(&tap, esp_timer_get_time() - since);
+    int64_t r = esp_timer_get_time();
+    if ((pages ? load_encode(p, pages, script, which) : load_card(p, &ex)) < 0)
+      readfails++;
+    else if (pages)
+    {
+      load_add(&enc, esp_timer_get_time() - r);
+      reads++;
+    }
+    else
+      reads++;
+    while (esp_timer_get_time() < end && pn532_Present(p) > 0)
+      ; // Wait for card to go
+  }
+  double run = (esp_timer_get_time() - start) / 1000000.0;
+  pn532_sim_stats_t sim;
+  pn532_sim_stats(&sim);
+  pn532_recovery_t rec = {0};
+  pn532_recovery(p, &rec);
+  printf("taps       %u in %.1fs, detected %u (%.2f/s), missed %u\n", sim.taps, run, detected, detected / run, sim.taps > detected ? sim.taps - detected : 0);
+  printf("reads      ok %u failed %u, poll errors %u\n", reads, readfails, errors);
+  load_report(&tap);
+  load_report(&poll);
+  load_report(&ex);
+  if (pages)
+    load_report(&enc);
+  printf("recovery   resyncs %u (gave up %u) retries %u recovered %u wakes %u failures %u\n", rec.resyncs, rec.badresyncs, rec.retries, rec.recovered, rec.wakes,
+         rec.failures);
+  printf("faults     bit errors %u drops %u error frames %u bad host frames %u\n", sim.bit_errors, sim.drops, sim.errors, sim.bad);
+  printf("pn532      commands %u polls %u exchanges %u aborts %u nacks %u\n", sim.commands, sim.polls, sim.exchanges, sim.aborts, sim.nacks);
+  if (lp)
+  {
+    pn532_lp_stats_t s;
+    pn532_lp_stats(p, &s);
+    printf("low power  powerdowns %u wakes %u detections %u wake-uid mean=%u max=%u us, down %.1f%%\n", s.powerdowns, s.wakes, s.detections,
+           s.detections ? (uint32_t)(s.total_uid_us / s.detections) : 0, s.max_uid_us, 100.0 * s.down_us / (s.up_us + s.down_us));
+  }
+  if (protos)
+  {
+    pn532_proto_stats_t s[PN532_PROTO_MAX];
+    uint8_t order[PN532_PROTO_MAX];
+    int n = pn532_multi_stats(&multi, s, order);
+    printf("multi      cycles %u mean=%u us, detects %u cycle start to card mean=%u us, order", multi.cycles,
+           multi.cycles ? (uint32_t)(multi.cycle_us / multi.cycles) : 0, multi.detects,
+           multi.detects ? (uint32_t)(multi.hit_us / multi.detects) : 0);
+    for (int i = 0; i < n; i++)
+      printf("%s%s", i ? ", " : " ", pn532_proto_name(order[i]));
+    printf("\n");
+    for (int i = 0; i < n; i++)
+    {
+      pn532_proto_stats_t *t = &s[order[i]];
+      uint32_t misses = t->polls - t->hits - t->errors;
+      printf("%-10s polls %u hits %u errors %u skips %u weight %u miss mean=%u us\n", pn532_proto_name(order[i]), t->polls, t->hits,
+             t->errors, t->skips, t->weight, misses ? (uint32_t)(t->miss_us / misses) : 0);
+    }
+  }
+  if (min > 0 && detected / run < min)
+    return 1;
+  return 0;
+}
@@ -0,0 +1,1143 @@
+// Virtual PN532 for running the driver on Linux
+// Implements the host UART calls (driver/uart.h) against an in-process PN532
+// that parses HSU frames from the driver and sends ACK/NACK, normal, extended
+// and error frames back, a byte at a time at the UART bit rate. Virtual cards
+// (NTAG21x, MIFARE Classic 1K, DESFire like ISO-DEP, and Type B, FeliCa and
+// Jewel) answer InListPassiveTarget, InDataExchange and InCommunicateThru.
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "pn532-sim.h"
+#include <driver/uart.h>
+
+#define SIM_CARDS 8    // Virtual cards
+#define SIM_MEM 1024   // Card memory (NTAG pages, Classic blocks)
+#define SIM_IN 1024    // Bytes from host not yet parsed
+#define SIM_OUT 4096   // Bytes to host not yet due
+#define SIM_RX 4096    // Bytes to host due and not yet read (UART rx buffer)
+#define SIM_FRAME 300  // Largest frame
+#define SIM_AIR_US 85  // Card air time per byte at 106 kbps
+#define SIM_WAKE_US 1000 // HSU wake to ready, bytes before then are lost
+
+typedef struct
+{
+  pn532_sim_card_t type;
+  uint8_t uid[7];
+  uint8_t uidlen;
+  uint16_t pages;      // NTAG pages
+  uint8_t mem[SIM_MEM]; // NTAG pages or Classic blocks
+  uint32_t tap;        // Tap the state below is for
+  uint8_t active;      // Selected by InListPassiveTarget
+  uint8_t br;          // Bit rate from InPSL (0-3)
+  uint8_t sector;      // Classic sector authenticated (0xFF for none)
+  uint8_t version;     // DESFire GetVersion part next
+} sim_card_t;
+
+static struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t rxcond; // Bytes due for host
+  pthread_cond_t wake;   // Sim thread
+  pthread_t thread;
+  int running;
+  int installed;
+  QueueHandle_t queue;  // UART events
+  uint32_t byte_us;     // Byte time at current UART rate
+  uint32_t baud_us;     // Byte time after SetSerialBaudRate and host ACK
+  pn532_sim_config_t cfg;
+  pn532_sim_stats_t stats;
+  uint64_t rnd;
+  uint8_t in[SIM_IN]; // From host
+  int inlen;
+  struct
+  {
+    int64_t due;
+    uint8_t byte;
+    uint8_t response; // Part of a response (host ACK drops it)
+  } out[SIM_OUT];
+  int outhead;
+  int outcount;
+  int64_t outlast;     // When last byte scheduled is due
+  uint8_t rx[SIM_RX];  // Due for host
+  int rxhead;
+  int rxcount;
+  uint8_t last[SIM_FRAME + 10]; // Last response frame (for NACK)
+  int lastlen;
+  uint8_t ilpt;        // InListPassiveTarget waiting for a card
+  uint8_t ilptbrty;    // BrTy it is for
+  uint8_t ilptrc;      // FeliCa request code it is for
+  int64_t ilptnext;    // Next attempt
+  int ilptleft;        // Attempts left (-1 for forever)
+  uint8_t passive;     // MxRtyPassiveActivation
+  uint8_t sfr[256];    // 0xFFxx registers
+  uint8_t asleep;      // In PowerDown
+  uint8_t wakeup;      // PowerDown WakeUpEnable
+  int64_t asleepat;    // When PowerDown started
+  int64_t readyat;     // Input ignored before this after wake
+  int phoneapdus;      // APDUs per phone session (0 for no phone)
+  int phonegap_ms;     // TgInitAsTarget to phone selecting us
+  uint8_t tgwait;      // TgInitAsTarget waiting for the phone
+  int64_t tgnext;      // When the phone comes
+  int tgleft;          // APDUs left this session (-1 for not in a session)
+  int64_t tgsent;      // When TgGetData response was all sent
+  sim_card_t cards[SIM_CARDS];
+  int ncards;
+  int manual;          // Card put in field by hand (-1 for none)
+  int64_t manualsince; // When
+  uint32_t manualtap;  // Taps by hand
+  int present_ms;      // Schedule (0 for none)
+  int absent_ms;
+  int64_t schedstart;
+} sim = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .byte_us = 87, // 115200 Baud
+    .cfg = {.ack_us = 400, .response_us = 600, .card_us = 1000, .poll_us = 5000, .seed = 1},
+    .rnd = 1,
+    .passive = 0xFF,
+    .manual = -1,
+    .tgleft = -1,
+};
+
+static double sim_rand(void)
+{ // xorshift64*, repeatable for a given seed
+  sim.rnd ^= sim.rnd >> 12;
+  sim.rnd ^= sim.rnd << 25;
+  sim.rnd ^= sim.rnd >> 27;
+  return (double)((sim.rnd * 2685821657736338717ULL) >> 11) / (double)(1ULL << 53);
+}
+
+static void sim_deadline(struct timespec *ts, int64_t us)
+{
+  clock_gettime(CLOCK_MONOTONIC, ts);
+  uint64_t ns = ts->tv_nsec + us * 1000ULL;
+  ts->tv_sec += ns / 1000000000ULL;
+  ts->tv_nsec = ns % 1000000000ULL;
+}
+
+// Cards
+static int sim_card(int64_t now, int64_t *since, uint32_t *tap)
+{ // Card in field (-1 for none), reset its state if newly tapped
+  int c = -1;
+  int64_t s = 0;
+  uint32_t t = 0;
+  if (sim.present_ms && sim.ncards)
+  { // Schedule, absent then present
+    int64_t period = (sim.present_ms + sim.absent_ms) * 1000LL,
+            k = (now - sim.schedstart) / period,
+            phase = (now - sim.schedstart) % period;
+    t = k + (phase >= sim.absent_ms * 1000LL);
+    if (phase >= sim.absent_ms * 1000LL)
+    {
+      c = k % sim.ncards;
+      s = sim.schedstart + k * period + sim.absent_ms * 1000LL;
+    }
+  }
+  else
+  {
+    c = sim.manual;
+    s = sim.manualsince;
+    t = sim.manualtap;
+  }
+  sim.stats.taps = t;
+  if (c >= 0 && sim.cards[c].tap != t)
+  { // Newly in field
+    sim.cards[c].tap = t;
+    sim.cards[c].active = 0;
+    sim.cards[c].br = 0;
+    sim.cards[c].sector = 0xFF;
+    sim.cards[c].version = 0;
+  }
+  if (since)
+    *since = s;
+  if (tap)
+    *tap = t;
+  return c;
+}
+
+static int sim_ntag(sim_card_t *c, const uint8_t *d, int len, uint8_t *res)
+{ // Type 2 command, returns response len or -ve PN532 status
+  int page = (len > 1 ? d[1] : 0);
+  switch (d[0])
+  {
+  case 0x60: // GET_VERSION
+  {
+    if (c->type == PN532_SIM_NTAG203)
+    { // Not supported, NAK and halt
+      c->active = 0;
+      return -0x01;
+    }
+    const uint8_t size[] = {[PN532_SIM_NTAG213] = 0x0F, [PN532_SIM_NTAG215] = 0x11, [PN532_SIM_NTAG216] = 0x13};
+    const uint8_t v[] = {0x00, 0x04, 0x04, 0x02, 0x01, 0x00, size[c->type], 0x03};
+    memcpy(res, v, sizeof(v));
+    return sizeof(v);
+  }
+  case 0x30: // READ, 4 pages rolling over
+    if (len < 2 || page >= c->pages)
+      return -0x01; // NAK
+    for (int i = 0; i < 16; i++)
+      res[i] = c->mem[((page * 4) + i) % (c->pages * 4)];
+    return 16;
+  case 0x3A: // FAST_READ
+    if (len < 3 || d[2] < page || d[2] >= c->pages)
+      return -0x01;
+    memcpy(res, c->mem + page * 4, (d[2] - page + 1) * 4);
+    return (d[2] - page + 1) * 4;
+  case 0xA2: // WRITE
+    if (len < 6 || page < 4 || page >= c->pages)
+      return -0x01;
+    memcpy(c->mem + page * 4, d + 2, 4);
+    return 0;
+  }
+  return -0x01;
+}
+
+static int sim_classic(sim_card_t *c, const uint8_t *d, int len, uint8_t *res)
+{ // MIFARE Classic command (PN532 does the crypto), returns response len or -ve PN532 status
+  int block = (len > 1 ? d[1] : 0);
+  if (block >= 64)
+    return -0x01;
+  uint8_t *trailer = c->mem + (block | 3) * 16;
+  switch (d[0])
+  {
+  case 0x60: // Authenticate key A
+  case 0x61: // Authenticate key B
+    if (len < 12 || memcmp(d + 2, trailer + (d[0] == 0x60 ? 0 : 10), 6) || memcmp(d + 8, c->uid, 4))
+    {
+      c->sector = 0xFF;
+      return -0x14; // Authentication error
+    }
+    c->sector = block / 4;
+    return 0;
+  case 0x30: // Read
+    if (c->sector != block / 4)
+      return -0x14;
+    memcpy(res, c->mem + block * 16, 16);
+    if ((block & 3) == 3)
+      memset(res, 0, 6); // Key A not readable
+    return 16;
+  case 0xA0: // Write
+    if (c->sector != block / 4)
+      return -0x14;
+    if (len < 18 || !block)
+      return -0x01;
+    memcpy(c->mem + block * 16, d + 2, 16);
+    return 0;
+  }
+  return -0x01;
+}
+
+static int sim_desfire_native(sim_card_t *c, uint8_t cmd, const uint8_t *d, int len, uint8_t *res)
+{ // DESFire native command, response is status then data
+  static const uint8_t hw[] = {0x04, 0x01, 0x01, 0x01, 0x00, 0x18, 0x05},
+                       sw[] = {0x04, 0x01, 0x01, 0x01, 0x04, 0x18, 0x05};
+  if (cmd != 0xAF)
+    c->version = 0;
+  switch (cmd)
+  {
+  case 0x60: // GetVersion
+    res[0] = 0xAF;
+    memcpy(res + 1, hw, sizeof(hw));
+    c->version = 1;
+    return 1 + sizeof(hw);
+  case 0xAF: // Additional frame
+    if (c->version == 1)
+    {
+      res[0] = 0xAF;
+      memcpy(res + 1, sw, sizeof(sw));
+      c->version = 2;
+      return 1 + sizeof(sw);
+    }
+    if (c->version == 2)
+    {
+      res[0] = 0x00;
+      memcpy(res + 1, c->uid, 7);
+      memcpy(res + 8, "\x01\x02\x03\x04\x05\x15\x24", 7); // Batch, week, year
+      c->version = 0;
+      return 15;
+    }
+    res[0] = 0xCA; // Command aborted
+    return 1;
+  case 0x5A: // SelectApplication
+  case 0x6A: // GetApplicationIDs (none)
+    res[0] = 0x00;
+    return 1;
+  case 0x45: // GetKeySettings
+    res[0] = 0x00;
+    res[1] = 0x0F;
+    res[2] = 0x01;
+    return 3;
+  case 0x6E: // FreeMemory
+    res[0] = 0x00;
+    res[1] = 0x00;
+    res[2] = 0x1C;
+    res[3] = 0x00;
+    return 4;
+  }
+  res[0] = 0x1C; // Illegal command code
+  return 1;
+}
+
+static int sim_desfire(sim_card_t *c, const uint8_t *d, int len, uint8_t *res)
+{ // ISO-DEP APDU (PN532 does the block framing), returns response len
+  if (len >= 5 && d[0] == 0x90)
+  { // Wrapped native command, status as 91 xx at end
+    uint8_t r[32];
+    int l = sim_desfire_native(c, d[1], d + 5, d[4], r);
+    memcpy(res, r + 1, l - 1);
+    res[l - 1] = 0x91;
+    res[l] = r[0];
+    return l + 1;
+  }
+  if (len >= 4 && d[0] == 0x00)
+  { // ISO7816
+    res[0] = (d[1] == 0xA4 ? 0x90 : 0x6D);
+    res[1] = 0x00;
+    return 2;
+  }
+  return sim_desfire_native(c, d[0], d + 1, len - 1, res);
+}
+
+static int sim_exchange(int64_t now, const uint8_t *d, int len, uint8_t *res, uint32_t *us)
+{ // Card exchange, returns response len or -ve PN532 status
+  int n = sim_card(now, NULL, NULL);
+  if (n < 0 || !sim.cards[n].active)
+    return -0x01; // Timeout
+  sim_card_t *c = &sim.cards[n];
+  sim.stats.exchanges++;
+  int l = -0x01;
+  if (len)
+    switch (c->type)
+    {
+    case PN532_SIM_NTAG213:
+    case PN532_SIM_NTAG215:
+    case PN532_SIM_NTAG216:
+    case PN532_SIM_NTAG203:
+      l = sim_ntag(c, d, len, res);
+      break;
+    case PN532_SIM_CLASSIC_1K:
+      l = sim_classic(c, d, len, res);
+      break;
+    case PN532_SIM_FELICA:
+    case PN532_SIM_JEWEL:
+      break; // Polling only
+    default:
+      l = sim_desfire(c, d, len, res);
+      break;
+    }
+  *us += sim.cfg.card_us + (len + (l > 0 ? l : 0)) * (SIM_AIR_US >> c->br);
+  return l;
+}
+
+static int sim_brty(pn532_sim_card_t type, uint8_t brty)
+{ // Card answers polls of this BrTy
+  switch (type)
+  {
+  case PN532_SIM_TYPEB:
+    return brty == 3;
+  case PN532_SIM_FELICA:
+    return brty == 1 || brty == 2;
+  case PN532_SIM_JEWEL:
+    return brty == 4;
+  default:
+    return brty == 0;
+  }
+}
+
+static int sim_target(int64_t now, uint8_t brty, uint8_t rc, uint8_t *res)
+{ // InListPassiveTarget response if a card of BrTy is in field, else 0
+  int n = sim_card(now, NULL, NULL);
+  if (n < 0 || !sim_brty(sim.cards[n].type, brty))
+    return 0;
+  sim_card_t *c = &sim.cards[n];
+  int l = 0;
+  res[l++] = 1; // NbTg
+  res[l++] = 1; // Tg
+  switch (c->type)
+  {
+  case PN532_SIM_TYPEB:
+  { // ATQB (PUPI, no AFI, ISO/IEC14443-4), ATTRIB_RES
+    static const uint8_t atqb[] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x81, 0x71};
+    res[l++] = 0x50;
+    memcpy(res + l, c->uid, 4);
+    l += 4;
+    memcpy(res + l, atqb, sizeof(atqb));
+    l += sizeof(atqb);
+    res[l++] = 1;
+    res[l++] = 0x00;
+    c->active = 1;
+    c->br = 0;
+    return l;
+  }
+  case PN532_SIM_FELICA:
+  { // POL_RES, IDm from UID, system code if asked for
+    static const uint8_t pmm[] = {0x01, 0x20, 0x22, 0x04, 0x27, 0x67, 0x4E, 0xFF};
+    res[l++] = (rc == 1 ? 20 : 18);
+    res[l++] = 0x01;
+    res[l++] = 0x01;
+    memcpy(res + l, c->uid, 7);
+    l += 7;
+    memcpy(res + l, pmm, sizeof(pmm));
+    l += sizeof(pmm);
+    if (rc == 1)
+    {
+      res[l++] = 0x00;
+      res[l++] = 0x03;
+    }
+    c->active = 1;
+    return l;
+  }
+  case PN532_SIM_JEWEL:
+    res[l++] = 0x0C; // SENS_RES
+    res[l++] = 0x00;
+    memcpy(res + l, c->uid, 4);
+    l += 4;
+    c->active = 1;
+    return l;
+  case PN532_SIM_CLASSIC_1K:
+    res[l++] = 0x00;
+    res[l++] = 0x04;
+    res[l++] = 0x08;
+    break;
+  case PN532_SIM_DESFIRE:
+    res[l++] = 0x03;
+    res[l++] = 0x44;
+    res[l++] = 0x20;
+    break;
+  default:
+    res[l++] = 0x00;
+    res[l++] = 0x44;
+    res[l++] = 0x00;
+    break;
+  }
+  res[l++] = c->uidlen;
+  memcpy(res + l, c->uid, c->uidlen);
+  l += c->uidlen;
+  if (c->type == PN532_SIM_DESFIRE)
+  { // ATS, TA(1) 212/424/848 both ways
+    static const uint8_t ats[] = {0x06, 0x75, 0x77, 0x81, 0x02, 0x80};
+    memcpy(res + l, ats, sizeof(ats));
+    l += sizeof(ats);
+  }
+  c->active = 1;
+  c->br = 0;
+  c->sector = 0xFF;
+  return l;
+}
+
+// Frames to host
+static void sim_send(const uint8_t *f, int len, int response, int64_t at)
+{ // Schedule bytes, one byte time apart
+  if (sim.cfg.drop > 0 && sim_rand() < sim.cfg.drop)
+  {
+    sim.stats.drops++;
+    return;
+  }
+  if (at < sim.outlast)
+    at = sim.outlast;
+  for (int i = 0; i < len && sim.outcount < SIM_OUT; i++)
+  {
+    int o = (sim.outhead + sim.outcount++) % SIM_OUT;
+    at += sim.byte_us;
+    sim.out[o].due = at;
+    sim.out[o].byte = f[i];
+    sim.out[o].response = response;
+  }
+  sim.outlast = at;
+  pthread_cond_signal(&sim.wake);
+}
+
+static void sim_ack(int64_t at)
+{
+  static const uint8_t ack[] = {0x00, 0x00, 0xFF, 0x00, 0xFF, 0x00};
+  sim_send(ack, sizeof(ack), 0, at);
+}
+
+static void sim_error(int64_t at)
+{ // Application level error frame
+  static const uint8_t err[] = {0x00, 0x00, 0xFF, 0x01, 0xFF, 0x7F, 0x81, 0x00};
+  sim.stats.errors++;
+  sim_send(err, sizeof(err), 1, at);
+}
+
+static void sim_response(uint8_t cmd, const uint8_t *d, int len, int64_t at)
+{ // Response frame, extended if needed
+  uint8_t *f = sim.last;
+  int l = 0,
+      n = len + 2;
+  f[l++] = 0x00;
+  f[l++] = 0x00;
+  f[l++] = 0xFF;
+  if (n > 255)
+  {
+    f[l++] = 0xFF;
+    f[l++] = 0xFF;
+    f[l++] = n >> 8;
+    f[l++] = n;
+    f[l++] = -(uint8_t)((n >> 8) + n);
+  }
+  else
+  {
+    f[l++] = n;
+    f[l++] = -n;
+  }
+  uint8_t sum = 0xD5 + cmd;
+  f[l++] = 0xD5;
+  f[l++] = cmd;
+  for (int i = 0; i < len; i++)
+    sum += (f[l++] = d[i]);
+  f[l++] = -sum;
+  f[l++] = 0x00;
+  sim.lastlen = l;
+  if (sim.cfg.error > 0 && sim_rand() < sim.cfg.error)
+    sim_error(at);
+  else
+    sim_send(f, l, 1, at);
+}
+
+static void sim_abort(void)
+{ // Host ACK - drop response not yet sent
+  int n = 0;
+  for (int i = 0; i < sim.outcount; i++)
+  {
+    int o = (sim.outhead + i) % SIM_OUT;
+    if (!sim.out[o].response)
+      sim.out[(sim.outhead + n++) % SIM_OUT] = sim.out[o];
+  }
+  if (n != sim.outcount || sim.ilpt)
+    sim.stats.aborts++;
+  sim.outcount = n;
+  sim.outlast = (n ? sim.out[(sim.outhead + n - 1) % SIM_OUT].due : 0);
+  sim.ilpt = 0;
+  sim.tgwait = 0;
+  if (sim.baud_us)
+  { // SetSerialBaudRate takes effect on host ACK
+    sim.byte_us = sim.baud_us;
+    sim.baud_us = 0;
+  }
+}
+
+// Commands from host
+static void sim_command(int64_t now, const uint8_t *d, int len)
+{ // d is command code and data
+  uint8_t res[SIM_FRAME];
+  int l = 0;
+  uint32_t us = sim.cfg.response_us;
+  uint8_t cmd = d[0];
+  d++;
+  len--;
+  int64_t ack = now + sim.cfg.ack_us;
+  sim.stats.commands++;
+  sim_ack(ack);
+  switch (cmd)
+  {
+  case 0x00: // Diagnose
+    if (len && d[0] == 6)
+    { // ISO-DEP presence
+      int n = sim_card(now, NULL, NULL);
+      res[l++] = (n >= 0 && sim.cards[n].active ? 0x00 : 0x01);
+    }
+    else
+      res[l++] = 0x00;
+    break;
+  case 0x02: // GetFirmwareVersion
+    res[l++] = 0x32;
+    res[l++] = 0x01;
+    res[l++] = 0x06;
+    res[l++] = 0x07;
+    break;
+  case 0x06: // ReadRegister
+    for (int i = 0; i + 1 < len; i += 2)
+      res[l++] = (d[i] == 0xFF ? sim.sfr[d[i + 1]] : 0);
+    break;
+  case 0x08: // WriteRegister
+    for (int i = 0; i + 2 < len; i += 3)
+      if (d[i] == 0xFF)
+        sim.sfr[d[i + 1]] = d[i + 2];
+    break;
+  case 0x0C: // ReadGPIO
+    res[l++] = sim.sfr[0xB0];
+    res[l++] = sim.sfr[0xF7];
+    res[l++] = 0x00;
+    break;
+  case 0x0E: // WriteGPIO
+    if (len > 0 && (d[0] & 0x80))
+      sim.sfr[0xB0] = d[0] & 0x3F;
+    if (len > 1 && (d[1] & 0x80))
+      sim.sfr[0xF7] = d[1] & 0x06;
+    break;
+  case 0x10: // SetSerialBaudRate
+  {
+    static const uint32_t rate[] = {9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600, 1288000};
+    if (!len || d[0] > 8)
+    {
+      sim_error(ack + us);
+      return;
+    }
+    sim.baud_us = 10000000 / rate[d[0]];
+    break;
+  }
+  case 0x16: // PowerDown, after the response
+    if (!len)
+    {
+      sim_error(ack + us);
+      return;
+    }
+    sim.wakeup = d[0];
+    sim.asleep = 1;
+    sim.asleepat = ack + us;
+    sim.stats.powerdowns++;
+    res[l++] = 0x00;
+    break;
+  case 0x12: // SetParameters
+  case 0x14: // SAMConfiguration
+    break;
+  case 0x32: // RFConfiguration
+    if (len >= 4 && d[0] == 5)
+      sim.passive = d[3];
+    break;
+  case 0x40: // InDataExchange
+  case 0x42: // InCommunicateThru
+  {
+    int o = (cmd == 0x40);
+    int r = sim_exchange(now, d + o, len - o, res + 1, &us);
+    res[0] = (r < 0 ? -r : 0);
+    l = 1 + (r > 0 ? r : 0);
+    break;
+  }
+  case 0x44: // InDeselect
+  case 0x52: // InRelease
+  {
+    int n = sim_card(now, NULL, NULL);
+    if (cmd == 0x52 && n >= 0)
+      sim.cards[n].active = 0;
+    res[l++] = 0x00;
+    break;
+  }
+  case 0x4A: // InListPassiveTarget
+    sim.stats.polls++;
+    if (len < 2)
+    {
+      res[l++] = 0;
+      us += sim.cfg.poll_us;
+      break;
+    }
+    sim.ilptbrty = d[1];
+    sim.ilptrc = ((d[1] == 1 || d[1] == 2) && len >= 6 ? d[5] : 0);
+    l = sim_target(now, sim.ilptbrty, sim.ilptrc, res);
+    if (l)
+    {
+      us += sim.cfg.card_us;
+      break;
+    }
+    if (!sim.passive)
+    { // One go
+      res[l++] = 0;
+      us += sim.cfg.poll_us;
+      break;
+    }
+    // Keep trying, sim thread sends response
+    sim.ilpt = 1;
+    sim.ilptleft = (sim.passive == 0xFF ? -1 : sim.passive);
+    sim.ilptnext = ack + us + sim.cfg.poll_us;
+    return;
+  case 0x8C: // TgInitAsTarget, response when the phone comes
+    sim.tgleft = -1;
+    if (!sim.phoneapdus)
+      return; // Nobody, host gives up and aborts
+    sim.tgwait = 1;
+    sim.tgnext = ack + us + sim.phonegap_ms * 1000LL;
+    return;
+  case 0x86: // TgGetData
+    if (sim.tgleft < 0)
+      res[l++] = 0x25; // Not a target
+    else if (!sim.tgleft)
+    { // Phone done
+      res[l++] = 0x29;
+      sim.tgleft = -1;
+    }
+    else
+    {
+      static const uint8_t select[] = {0x00, 0xA4, 0x04, 0x00, 0x07, 0xD2, 0x76, 0x00, 0x00, 0x85, 0x01, 0x01, 0x00},
+                           read[] = {0x00, 0xB0, 0x00, 0x00, 0x20};
+      int first = (sim.tgleft-- == sim.phoneapdus);
+      res[l++] = 0x00;
+      memcpy(res + l, first ? select : read, first ? sizeof(select) : sizeof(read));
+      l += (first ? sizeof(select) : sizeof(read));
+      us += sim.cfg.card_us + (l - 1) * SIM_AIR_US;
+      sim.stats.apdus++;
+    }
+    sim_response(cmd + 1, res, l, ack + us);
+    sim.tgsent = sim.outlast;
+    return;
+  case 0x8E: // TgSetData
+    if (sim.tgleft < 0)
+      res[l++] = 0x25;
+    else
+    {
+      uint32_t turn = (now > sim.tgsent ? now - sim.tgsent : 0);
+      sim.stats.turn_us += turn;
+      if (turn > sim.stats.max_turn_us)
+        sim.stats.max_turn_us = turn;
+      if (len < 2 || d[len - 2] != 0x90 || d[len - 1] != 0x00)
+        sim.stats.bad_sw++;
+      us += sim.cfg.card_us + len * SIM_AIR_US;
+      res[l++] = 0x00;
+    }
+    break;
+  case 0x4E: // InPSL
+  {
+    int n = sim_card(now, NULL, NULL);
+    if (len < 3 || n < 0 || !sim.cards[n].active || sim.cards[n].type != PN532_SIM_DESFIRE || d[1] > 3 || d[2] > 3)
+      res[l++] = 0x27; // Not acceptable
+    else
+    {
+      sim.cards[n].br = (d[1] < d[2] ? d[1] : d[2]);
+      res[l++] = 0x00;
+    }
+    break;
+  }
+  default:
+    sim_error(ack + us);
+    return;
+  }
+  sim_response(cmd + 1, res, l, ack + us);
+}
+
+static void sim_input(int64_t now)
+{ // Parse frames from host
+  int i = 0;
+  if (sim.asleep)
+  { // Only HSU wake up (0x55) is seen
+    while (i < sim.inlen && !(sim.in[i] == 0x55 && (sim.wakeup & 0x10)))
+      i++;
+    if (i < sim.inlen)
+    {
+      sim.asleep = 0;
+      sim.stats.wakes++;
+      if (now > sim.asleepat)
+        sim.stats.asleep_us += now - sim.asleepat;
+      sim.readyat = now + SIM_WAKE_US;
+      i = sim.inlen; // Rest lost while oscillator starts
+    }
+  }
+  while (1)
+  {
+    while (i + 1 < sim.inlen && !(sim.in[i] == 0x00 && sim.in[i + 1] == 0xFF))
+      i++; // Preamble (skips wake up bytes and postambles)
+    if (i + 4 > sim.inlen)
+      break;
+    uint8_t len = sim.in[i + 2],
+            lcs = sim.in[i + 3];
+    if (!len && lcs == 0xFF)
+    { // ACK
+      sim_abort();
+      i += 4;
+      continue;
+    }
+    if (len == 0xFF && !lcs)
+    { // NACK, send last response again
+      sim.stats.nacks++;
+      if (sim.lastlen)
+        sim_send(sim.last, sim.lastlen, 1, now);
+      i += 4;
+      continue;
+    }
+    int n = len,
+        s = i + 4;
+    if (len == 0xFF && lcs == 0xFF)
+    { // Extended
+      if (i + 7 > sim.inlen)
+        break;
+      n = (sim.in[i + 4] << 8) + sim.in[i + 5];
+      if ((uint8_t)(sim.in[i + 4] + sim.in[i + 5] + sim.in[i + 6]))
+      {
+        sim.stats.bad++;
+        i += 2;
+        continue;
+      }
+      s = i + 7;
+    }
+    else if ((uint8_t)(len + lcs))
+    {
+      sim.stats.bad++;
+      i += 2;
+      continue;
+    }
+    if (n > SIM_FRAME || n < 2)
+    {
+      sim.stats.bad++;
+      i += 2;
+      continue;
+    }
+    if (s + n + 1 > sim.inlen)
+      break; // Rest of frame to come
+    uint8_t sum = 0;
+    for (int j = 0; j <= n; j++)
+      sum += sim.in[s + j];
+    if (sum || sim.in[s] != 0xD4)
+      sim.stats.bad++; // Ignored, host times out waiting for ACK
+    else
+      sim_command(now + (s + n + 2 - i) * sim.byte_us, sim.in + s + 1, n - 1);
+    i = s + n + 1;
+  }
+  if (i > sim.inlen)
+    i = sim.inlen;
+  memmove(sim.in, sim.in + i, sim.inlen - i);
+  sim.inlen -= i;
+}
+
+static void *sim_thread(void *arg)
+{ // Deliver bytes to host when due, and poll for cards for a waiting InListPassiveTarget
+  pthread_mutex_lock(&sim.lock);
+  while (sim.running)
+  {
+    int64_t now = esp_timer_get_time();
+    int n = 0;
+    while (sim.outcount && sim.out[sim.outhead].due <= now)
+    {
+      uint8_t b = sim.out[sim.outhead].byte;
+      sim.outhead = (sim.outhead + 1) % SIM_OUT;
+      sim.outcount--;
+      if (sim.cfg.ber > 0)
+        for (int bit = 0; bit < 8; bit++)
+          if (sim_rand() < sim.cfg.ber)
+          {
+            b ^= (1 << bit);
+            sim.stats.bit_errors++;
+          }
+      if (sim.rxcount < SIM_RX)
+      {
+        sim.rx[(sim.rxhead + sim.rxcount++) % SIM_RX] = b;
+        n++;
+      }
+      else if (sim.queue)
+      {
+        uart_event_t e = {.type = UART_BUFFER_FULL};
+        xQueueSend(sim.queue, &e, 0);
+      }
+    }
+    if (!sim.outcount)
+      sim.outlast = 0;
+    if (n)
+    {
+      pthread_cond_broadcast(&sim.rxcond);
+      if (sim.queue)
+      { // As rx timeout interrupt at end of burst
+        uart_event_t e = {.type = UART_DATA, .size = n, .timeout_flag = !sim.outcount};
+        xQueueSend(sim.queue, &e, 0);
+      }
+    }
+    if (sim.ilpt && sim.ilptnext <= now)
+    { // Try again for a card
+      uint8_t res[32];
+      int l = sim_target(now, sim.ilptbrty, sim.ilptrc, res);
+      if (l || !sim.ilptleft)
+      {
+        sim.ilpt = 0;
+        if (!l)
+          res[l++] = 0; // None
+        sim_response(0x4B, res, l, now + sim.cfg.card_us);
+      }
+      else
+      {
+        if (sim.ilptleft > 0)
+          sim.ilptleft--;
+        sim.ilptnext = now + sim.cfg.poll_us;
+      }
+    }
+    if (sim.tgwait && sim.tgnext <= now)
+    { // Phone selects us (PN532 answers RATS itself)
+      static const uint8_t res[] = {0x04, 0xE0, 0x80}; // Mode, RATS
+      sim.tgwait = 0;
+      sim.tgleft = sim.phoneapdus;
+      sim.stats.sessions++;
+      sim_response(0x8D, res, sizeof(res), now + sim.cfg.card_us);
+    }
+    int64_t next = now + 1000;
+    if (sim.tgwait && sim.tgnext < next)
+      next = sim.tgnext;
+    if (sim.outcount && sim.out[sim.outhead].due < next)
+      next = sim.out[sim.outhead].due;
+    if (sim.ilpt && sim.ilptnext < next)
+      next = sim.ilptnext;
+    if (next > now)
+    {
+      struct timespec ts;
+      sim_deadline(&ts, next - now);
+      pthread_cond_timedwait(&sim.wake, &sim.lock, &ts);
+    }
+  }
+  pthread_mutex_unlock(&sim.lock);
+  return NULL;
+}
+
+static void sim_cond_init(pthread_cond_t *cond)
+{
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+// UART
+esp_err_t uart_driver_install(uart_port_t port, int rx_buffer_size, int tx_buffer_size, int queue_size, QueueHandle_t *uart_queue, int intr_alloc_flags)
+{
+  pthread_mutex_lock(&sim.lock);
+  if (sim.installed)
+  {
+    pthread_mutex_unlock(&sim.lock);
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (queue_size && uart_queue)
+    *uart_queue = sim.queue = xQueueCreate(queue_size, sizeof(uart_event_t));
+  sim.installed = 1;
+  sim.inlen = sim.outcount = sim.rxcount = 0;
+  sim.outlast = 0;
+  if (!sim.running)
+  {
+    sim_cond_init(&sim.rxcond);
+    sim_cond_init(&sim.wake);
+    sim.running = 1;
+    pthread_create(&sim.thread, NULL, sim_thread, NULL);
+  }
+  pthread_mutex_unlock(&sim.lock);
+  return ESP_OK;
+}
+
+esp_err_t uart_driver_delete(uart_port_t port)
+{
+  pthread_mutex_lock(&sim.lock);
+  if (sim.queue)
+    vQueueDelete(sim.queue);
+  sim.queue = NULL;
+  sim.installed = 0;
+  pthread_mutex_unlock(&sim.lock);
+  return ESP_OK;
+}
+
+bool uart_is_driver_installed(uart_port_t port)
+{
+  return sim.installed;
+}
+
+esp_err_t uart_param_config(uart_port_t port, const uart_config_t *config)
+{
+  return ESP_OK;
+}
+
+esp_err_t uart_set_pin(uart_port_t port, int tx, int rx, int rts, int cts)
+{
+  return ESP_OK;
+}
+
+esp_err_t uart_set_rx_timeout(uart_port_t port, const uint8_t tout)
+{
+  return ESP_OK;
+}
+
+esp_err_t uart_set_rx_full_threshold(uart_port_t port, int threshold)
+{
+  return ESP_OK;
+}
+
+int uart_write_bytes(uart_port_t port, const void *src, size_t size)
+{
+  pthread_mutex_lock(&sim.lock);
+  int64_t now = esp_timer_get_time();
+  const uint8_t *s = src;
+  size_t n = (now < sim.readyat ? 0 : size); // Lost if still waking up
+  for (size_t i = 0; i < n; i++)
+  {
+    if (sim.inlen == SIM_IN)
+      sim_input(now);
+    if (sim.inlen < SIM_IN)
+      sim.in[sim.inlen++] = s[i];
+  }
+  sim_input(now);
+  pthread_mutex_unlock(&sim.lock);
+  return size;
+}
+
+esp_err_t uart_wait_tx_done(uart_port_t port, TickType_t ticks)
+{
+  return ESP_OK;
+}
+
+int uart_read_bytes(uart_port_t port, void *buf, uint32_t length, TickType_t ticks)
+{
+  struct timespec ts;
+  sim_deadline(&ts, (int64_t)ticks * portTICK_PERIOD_MS * 1000);
+  pthread_mutex_lock(&sim.lock);
+  while (sim.rxcount < length && ticks && pthread_cond_timedwait(&sim.rxcond, &sim.lock, &ts) != ETIMEDOUT)
+    ;
+  int n = (sim.rxcount < length ? sim.rxcount : length);
+  uint8_t *b = buf;
+  for (int i = 0; i < n; i++)
+    b[i] = sim.rx[(sim.rxhead + i) % SIM_RX];
+  sim.rxhead = (sim.rxhead + n) % SIM_RX;
+  sim.rxcount -= n;
+  pthread_mutex_unlock(&sim.lock);
+  return n;
+}
+
+esp_err_t uart_flush_input(uart_port_t port)
+{
+  pthread_mutex_lock(&sim.lock);
+  sim.rxcount = 0;
+  if (sim.queue)
+    xQueueReset(sim.queue);
+  pthread_mutex_unlock(&sim.lock);
+  return ESP_OK;
+}
+
+esp_err_t uart_get_buffered_data_len(uart_port_t port, size_t *size)
+{
+  pthread_mutex_lock(&sim.lock);
+  *size = sim.rxcount;
+  pthread_mutex_unlock(&sim.lock);
+  return ESP_OK;
+}
+
+// Control
+void pn532_sim_config(const pn532_sim_config_t *c)
+{
+  pthread_mutex_lock(&sim.lock);
+  sim.cfg = *c;
+  sim.rnd = (c->seed ? c->seed : 1);
+  pthread_mutex_unlock(&sim.lock);
+}
+
+void pn532_sim_config_get(pn532_sim_config_t *c)
+{
+  pthread_mutex_lock(&sim.lock);
+  *c = sim.cfg;
+  pthread_mutex_unlock(&sim.lock);
+}
+
+int pn532_sim_add(pn532_sim_card_t type, const uint8_t *uid, uint8_t uidlen)
+{
+  if (type >= PN532_SIM_MAX || (uid && uidlen != 4 && uidlen != 7))
+    return -1;
+  pthread_mutex_lock(&sim.lock);
+  if (sim.ncards == SIM_CARDS)
+  {
+    pthread_mutex_unlock(&sim.lock);
+    return -1;
+  }
+  int n = sim.ncards++;
+  sim_card_t *c = &sim.cards[n];
+  memset(c, 0, sizeof(*c));
+  c->type = type;
+  c->sector = 0xFF;
+  c->tap = (uint32_t)-1;
+  if (uid)
+  {
+    c->uidlen = uidlen;
+    memcpy(c->uid, uid, uidlen);
+  }
+  else
+  { // Made up
+    c->uidlen = (type == PN532_SIM_CLASSIC_1K || type == PN532_SIM_TYPEB || type == PN532_SIM_JEWEL ? 4 : 7);
+    c->uid[0] = 0x04;
+    for (int i = 1; i < c->uidlen; i++)
+      c->uid[i] = 0x10 * (n + 1) + i;
+  }
+  if (type == PN532_SIM_CLASSIC_1K)
+  { // Manufacturer block, transport keys
+    memcpy(c->mem, c->uid, 4);
+    c->mem[4] = c->uid[0] ^ c->uid[1] ^ c->uid[2] ^ c->uid[3];
+    c->mem[5] = 0x08;
+    c->mem[6] = 0x04;
+    for (int b = 3; b < 64; b += 4)
+    {
+      uint8_t *t = c->mem + b * 16;
+      memset(t, 0xFF, 16);
+      t[6] = 0xFF;
+      t[7] = 0x07;
+      t[8] = 0x80;
+      t[9] = 0x69;
+    }
+  }
+  else if (type <= PN532_SIM_NTAG203)
+  { // NTAG: UID/BCC pages, CC, empty NDEF TLV
+    const uint16_t pages[] = {[PN532_SIM_NTAG213] = 45, [PN532_SIM_NTAG215] = 135, [PN532_SIM_NTAG216] = 231, [PN532_SIM_NTAG203] = 42};
+    const uint8_t cc[] = {[PN532_SIM_NTAG213] = 0x12, [PN532_SIM_NTAG215] = 0x3E, [PN532_SIM_NTAG216] = 0x6D, [PN532_SIM_NTAG203] = 0x12};
+    c->pages = pages[type];
+    memcpy(c->mem, c->uid, 3);
+    c->mem[3] = 0x88 ^ c->uid[0] ^ c->uid[1] ^ c->uid[2];
+    memcpy(c->mem + 4, c->uid + 3, 4);
+    c->mem[8] = c->uid[3] ^ c->uid[4] ^ c->uid[5] ^ c->uid[6];
+    c->mem[9] = 0x48;
+    c->mem[12] = 0xE1;
+    c->mem[13] = 0x10;
+    c->mem[14] = cc[type];
+    c->mem[16] = 0x03;
+    c->mem[17] = 0x00;
+    c->mem[18] = 0xFE;
+  }
+  pthread_mutex_unlock(&sim.lock);
+  return n;
+}
+
+void pn532_sim_insert(int card)
+{
+  pthread_mutex_lock(&sim.lock);
+  if (card >= 0 && card < sim.ncards)
+  {
+    sim.present_ms = 0;
+    sim.manual = card;
+    sim.manualsince = esp_timer_get_time();
+    sim.manualtap++;
+  }
+  pthread_mutex_unlock(&sim.lock);
+}
+
+void pn532_sim_remove(void)
+{
+  pthread_mutex_lock(&sim.lock);
+  sim.present_ms = 0;
+  sim.manual = -1;
+  pthread_mutex_unlock(&sim.lock);
+}
+
+void pn532_sim_schedule(int present_ms, int absent_ms)
+{
+  pthread_mutex_lock(&sim.lock);
+  sim.manual = -1;
+  sim.present_ms = (present_ms > 0 ? present_ms : 0);
+  sim.absent_ms = (absent_ms > 0 ? absent_ms : 0);
+  sim.schedstart = esp_timer_get_time();
+  for (int i = 0; i < sim.ncards; i++)
+    sim.cards[i].tap = (uint32_t)-1;
+  pthread_mutex_unlock(&sim.lock);
+}
+
+int pn532_sim_present(int64_t *since, uint32_t *tap)
+{
+  pthread_mutex_lock(&sim.lock);
+  int c = sim_card(esp_timer_get_time(), since, tap);
+  pthread_mutex_unlock(&sim.lock);
+  return c;
+}
+
+void pn532_sim_stats(pn532_sim_stats_t *s)
+{
+  pthread_mutex_lock(&sim.lock);
+  sim_card(esp_timer_get_time(), NULL, NULL);
+  *s = sim.stats;
+  pthread_mutex_unlock(&sim.lock);
+}
+
+void pn532_sim_phone(int apdus, int gap_ms)
+{
+  pthread_mutex_lock(&sim.lock);
+  sim.phoneapdus = (apdus > 0 ? apdus : 0);
+  sim.phonegap_ms = gap_ms;
+  pthread_mutex_unlock(&sim.lock);
+}
@@ -0,0 +1,84 @@
+// Virtual PN532 for running the driver on Linux
+// The host UART calls (driver/uart.h) talk to an in-process PN532 speaking the
+// HSU frame protocol, with virtual cards inserted by hand or on a schedule,
+// and configurable timing and fault injection
+
+#ifndef PN532_SIM_H
+#define PN532_SIM_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+  PN532_SIM_NTAG213,
+  PN532_SIM_NTAG215,
+  PN532_SIM_NTAG216,
+  PN532_SIM_NTAG203, // Type 2 without GET_VERSION, size from the CC
+  PN532_SIM_CLASSIC_1K,
+  PN532_SIM_DESFIRE, // ISO-DEP, DESFire native commands and ISO7816 APDUs
+  PN532_SIM_TYPEB,   // ISO/IEC14443 Type B, ISO7816 APDUs
+  PN532_SIM_FELICA,  // FeliCa at 212 and 424 kbps, polling only
+  PN532_SIM_JEWEL,   // Jewel/Topaz, polling only
+  PN532_SIM_MAX
+} pn532_sim_card_t;
+
+typedef struct {
+  uint32_t ack_us;      // Command received to ACK
+  uint32_t response_us; // ACK to response (firmware)
+  uint32_t card_us;     // Added for each card exchange (air time)
+  uint32_t poll_us;     // Each InListPassiveTarget attempt finding no card
+  double ber;           // Bit error rate on bytes from PN532 to host
+  double drop;          // Chance a frame from PN532 is lost
+  double error;         // Chance a command gets the error frame
+  uint32_t seed;        // Fault injection random seed
+} pn532_sim_config_t;
+
+typedef struct {
+  uint32_t commands;   // Good frames from host
+  uint32_t bad;        // Frames from host with bad checksum (ignored)
+  uint32_t aborts;     // Commands aborted by host ACK
+  uint32_t nacks;      // Responses sent again for host NACK
+  uint32_t errors;     // Error frames sent
+  uint32_t bit_errors; // Bits flipped
+  uint32_t drops;      // Frames lost
+  uint32_t polls;      // InListPassiveTarget commands
+  uint32_t exchanges;  // Card exchanges (InDataExchange/InCommunicateThru)
+  uint32_t taps;       // Cards inserted
+  uint32_t powerdowns; // PowerDown commands
+  uint32_t wakes;      // Woken by HSU
+  uint64_t asleep_us;  // Time in PowerDown
+  uint32_t sessions;   // Phone sessions with us as target
+  uint32_t apdus;      // APDUs the phone sent
+  uint32_t bad_sw;     // Responses not ending 90 00
+  uint32_t max_turn_us; // Phone wait, TgGetData response sent to TgSetData in
+  uint64_t turn_us;     // Phone wait, total
+} pn532_sim_stats_t;
+
+void pn532_sim_config(const pn532_sim_config_t *c); // Timing and faults
+void pn532_sim_config_get(pn532_sim_config_t *c);
+int pn532_sim_add(pn532_sim_card_t type, const uint8_t *uid,
+                  uint8_t uidlen); // Add a virtual card (UID 4 or 7 bytes, NULL
+                                   // for made up), returns card number
+void pn532_sim_insert(int card);   // Put card in field (stops schedule)
+void pn532_sim_remove(void);       // Take card out of field (stops schedule)
+void pn532_sim_schedule(int present_ms,
+                        int absent_ms); // Tap each card in turn, present then
+                                        // absent for the times given
+int pn532_sim_present(int64_t *since,
+                      uint32_t *tap); // Card in field (-1 for none), when it
+                                      // went in and which tap (counts from 1)
+void pn532_sim_stats(pn532_sim_stats_t *s);
+void pn532_sim_phone(int apdus,
+                     int gap_ms); // Phone for target mode, gap_ms after each
+                                  // TgInitAsTarget it selects us and sends
+                                  // SELECT then READ BINARY, apdus in all (0
+                                  // for no phone)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,256 @@
+// Host port of the ESP-IDF/FreeRTOS calls used by the PN532 driver (pthreads)
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include <driver/gpio.h>
+
+esp_log_level_t esp_log_host_level = ESP_LOG_WARN;
+
+static pthread_mutex_t port_critical = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+struct QueueDefinition
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  UBaseType_t length; // Items
+  UBaseType_t size;   // Item size
+  UBaseType_t head;   // Next to receive
+  UBaseType_t count;  // Items waiting
+  uint8_t data[];
+};
+
+// Time
+int64_t esp_timer_get_time(void)
+{
+  static int64_t start = 0;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  int64_t now = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+  if (!start)
+    start = now - 1;
+  return now - start;
+}
+
+static void port_deadline(struct timespec *ts, TickType_t ticks)
+{ // Absolute CLOCK_MONOTONIC time ticks from now
+  clock_gettime(CLOCK_MONOTONIC, ts);
+  uint64_t ns = ts->tv_nsec + (uint64_t)ticks * portTICK_PERIOD_MS * 1000000ULL;
+  ts->tv_sec += ns / 1000000000ULL;
+  ts->tv_nsec = ns % 1000000000ULL;
+}
+
+static void port_cond_init(pthread_cond_t *cond)
+{ // Condition variable timed against CLOCK_MONOTONIC
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+static int port_wait(pthread_cond_t *cond, pthread_mutex_t *mutex, TickType_t ticks, const struct timespec *ts)
+{ // Wait on cond, 0 if timed out
+  if (ticks == portMAX_DELAY)
+    return !pthread_cond_wait(cond, mutex);
+  return pthread_cond_timedwait(cond, mutex, ts) != ETIMEDOUT;
+}
+
+// Tasks
+void vTaskDelay(TickType_t ticks)
+{
+  usleep(ticks * portTICK_PERIOD_MS * 1000);
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+  return esp_timer_get_time() / 1000 / portTICK_PERIOD_MS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t prio, TaskHandle_t *task)
+{
+  pthread_t t;
+  if (pthread_create(&t, NULL, (void *(*)(void *))fn, arg))
+    return pdFAIL;
+  if (task)
+    *task = t;
+  else
+    pthread_detach(t);
+  return pdPASS;
+}
+
+void vPortEnterCritical(portMUX_TYPE *mux)
+{
+  pthread_mutex_lock(&port_critical);
+}
+
+void vPortExitCritical(portMUX_TYPE *mux)
+{
+  pthread_mutex_unlock(&port_critical);
+}
+
+// Semaphores
+SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t *s)
+{ // Created empty, as FreeRTOS
+  pthread_mutex_init(&s->mutex, NULL);
+  port_cond_init(&s->cond);
+  s->count = 0;
+  return s;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t s, TickType_t ticks)
+{
+  struct timespec ts;
+  port_deadline(&ts, ticks);
+  pthread_mutex_lock(&s->mutex);
+  while (!s->count && ticks && port_wait(&s->cond, &s->mutex, ticks, &ts))
+    ;
+  BaseType_t ok = (s->count ? pdTRUE : pdFALSE);
+  s->count = 0;
+  pthread_mutex_unlock(&s->mutex);
+  return ok;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t s)
+{
+  pthread_mutex_lock(&s->mutex);
+  BaseType_t ok = (s->count ? pdFALSE : pdTRUE);
+  s->count = 1;
+  pthread_cond_signal(&s->cond);
+  pthread_mutex_unlock(&s->mutex);
+  return ok;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t s)
+{
+  pthread_cond_destroy(&s->cond);
+  pthread_mutex_destroy(&s->mutex);
+}
+
+// Queues
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t size)
+{
+  QueueHandle_t q = malloc(sizeof(*q) + length * size);
+  if (!q)
+    return NULL;
+  pthread_mutex_init(&q->mutex, NULL);
+  port_cond_init(&q->cond);
+  q->length = length;
+  q->size = size;
+  q->head = q->count = 0;
+  return q;
+}
+
+void vQueueDelete(QueueHandle_t q)
+{
+  pthread_cond_destroy(&q->cond);
+  pthread_mutex_destroy(&q->mutex);
+  free(q);
+}
+
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t ticks)
+{ // Does not wait for space (all senders here are ISR like)
+  pthread_mutex_lock(&q->mutex);
+  BaseType_t ok = pdFALSE;
+  if (q->count < q->length)
+  {
+    memcpy(q->data + ((q->head + q->count) % q->length) * q->size, item, q->size);
+    q->count++;
+    pthread_cond_signal(&q->cond);
+    ok = pdTRUE;
+  }
+  pthread_mutex_unlock(&q->mutex);
+  return ok;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t ticks)
+{
+  struct timespec ts;
+  port_deadline(&ts, ticks);
+  pthread_mutex_lock(&q->mutex);
+  while (!q->count && ticks && port_wait(&q->cond, &q->mutex, ticks, &ts))
+    ;
+  BaseType_t ok = pdFALSE;
+  if (q->count)
+  {
+    memcpy(item, q->data + q->head * q->size, q->size);
+    q->head = (q->head + 1) % q->length;
+    q->count--;
+    ok = pdTRUE;
+  }
+  pthread_mutex_unlock(&q->mutex);
+  return ok;
+}
+
+BaseType_t xQueueReset(QueueHandle_t q)
+{
+  pthread_mutex_lock(&q->mutex);
+  q->head = q->count = 0;
+  pthread_mutex_unlock(&q->mutex);
+  return pdPASS;
+}
+
+// Misc
+const char *esp_err_to_name(esp_err_t e)
+{
+  switch (e)
+  {
+  case ESP_OK:
+    return "ESP_OK";
+  case ESP_ERR_NO_MEM:
+    return "ESP_ERR_NO_MEM";
+  case ESP_ERR_INVALID_ARG:
+    return "ESP_ERR_INVALID_ARG";
+  case ESP_ERR_INVALID_STATE:
+    return "ESP_ERR_INVALID_STATE";
+  case ESP_ERR_TIMEOUT:
+    return "ESP_ERR_TIMEOUT";
+  }
+  return "ESP_FAIL";
+}
+
+esp_err_t gpio_reset_pin(gpio_num_t n)
+{
+  return ESP_OK;
+}
+
+esp_err_t gpio_set_drive_capability(gpio_num_t n, gpio_drive_cap_t cap)
+{
+  return ESP_OK;
+}
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...)
+{
+  if (level > esp_log_host_level)
+    return;
+  static const char letter[] = "NEWIDV";
+  va_list ap;
+  va_start(ap, format);
+  fprintf(stderr, "%c (%lld) %s: ", letter[level], (long long)(esp_timer_get_time() / 1000), tag);
+  vfprintf(stderr, format, ap);
+  fputc('\n', stderr);
+  va_end(ap);
+}
+
+void esp_log_buffer_hex_internal(const char *tag, const void *buffer, int len, esp_log_level_t level)
+{
+  if (level > esp_log_host_level)
+    return;
+  const uint8_t *b = buffer;
+  fprintf(stderr, "%c %s:", "NEWIDV"[level], tag);
+  for (int i = 0; i < len; i++)
+    fprintf(stderr, " %02X", b[i]);
+  fputc('\n', stderr);
+}
@@ -0,0 +1,87 @@
+#!/usr/bin/env python3
+"""Worst case stack use of each public PN532 entry point.
+
+Build with CONFIG_PN532_STACK_USAGE set (adds -fstack-usage and
+-fcallgraph-info=su), then run on the build directory:
+
+    tools/stack_usage.py build
+
+The call graph from each entry point is walked adding the static frame sizes.
+Calls outside the component (ESP-IDF, FreeRTOS, libc) are listed rather than
+counted, so add the worst of those for the total task stack needed.
+"""
+
+import os
+import re
+import sys
+
+HEADER = os.path.join(os.path.dirname(__file__), "..", "hsu", "include", "pn532-hsu.h")
+
+node_re = re.compile(r'node: \{ title: "([^"]+)" label: "([^"]+)"')
+edge_re = re.compile(r'edge: \{ sourcename: "([^"]+)" targetname: "([^"]+)"')
+size_re = re.compile(r"\\n(\d+) bytes \((static|dynamic|dynamic,bounded)\)")
+
+
+def load(build):
+    frames = {}  # title -> (bytes, kind)
+    calls = {}  # title -> set of titles
+    for root, _, files in os.walk(build):
+        for f in files:
+            if not f.endswith(".ci") or "pn532" not in f:
+                continue
+            with open(os.path.join(root, f)) as ci:
+                for line in ci:
+                    m = node_re.search(line)
+                    if m:
+                        s = size_re.search(m.group(2))
+                        if s:
+                            frames[m.group(1)] = (int(s.group(1)), s.group(2))
+                        continue
+                    m = edge_re.search(line)
+                    if m:
+                        calls.setdefault(m.group(1), set()).add(m.group(2))
+    return frames, calls
+
+
+def public():
+    with open(HEADER) as h:
+        return sorted(set(re.findall(r"\b(pn532_\w+)\s*\(", h.read())))
+
+
+def worst(title, frames, calls, path):
+    """Worst case bytes below title, with external calls and cycles seen"""
+    size, kind = frames[title]
+    deepest = 0
+    external = set()
+    cycle = kind != "static"
+    for t in calls.get(title, ()):
+        if t in path:
+            cycle = True  # Recursion, only counted once
+            continue
+        if t not in frames:
+            external.add(t)
+            continue
+        d, e, c = worst(t, frames, calls, path | {t})
+        deepest = max(deepest, d)
+        external |= e
+        cycle |= c
+    return size + deepest, external, cycle
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit(__doc__)
+    frames, calls = load(sys.argv[1])
+    if not frames:
+        sys.exit("No pn532 .ci files found, is CONFIG_PN532_STACK_USAGE set?")
+    print("%-36s %6s  %s" % ("Entry point", "Bytes", "Plus"))
+    for name in public():
+        if name not in frames:
+            continue
+        d, e, c = worst(name, frames, calls, {name})
+        print("%-36s %6d%s %s" % (name, d, "*" if c else " ", ", ".join(sorted(e))))
+    print("* recursion or dynamic stack, bound is one level deep")
+
+
+if __name__ == "__main__":
+    main()